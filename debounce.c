@@ -6,8 +6,12 @@
  */ 
 
 
+// Options are only known once debounce.h is in, so nothing here can
+// depend on them
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -18,6 +22,48 @@ typedef enum {
 	RETURN_ERROR,
 } return_code_t;
 
+typedef enum {
+	BUTTON_TYPE_PIN,
+	BUTTON_TYPE_LADDER,
+	BUTTON_TYPE_CHORD,
+} button_type_t;
+
+#if defined(DEBOUNCE_ADC_LADDER) || defined(DEBOUNCE_CHORDS)
+#define BUTTON_TYPES
+#endif
+
+#define CHORD_DISARMED			0xff
+
+#if defined(DEBOUNCE_EVENTS) && !defined(DEBOUNCE_EVENT_HANDLER)
+#error DEBOUNCE_EVENTS needs a DEBOUNCE_EVENT_HANDLER
+#endif
+
+#ifdef DEBOUNCE_SERIAL_TICK
+#ifdef DEBOUNCE_TIMER1
+#error DEBOUNCE_SERIAL_TICK and DEBOUNCE_TIMER1 can not be combined
+#endif
+#elif defined(DEBOUNCE_TIMER1)
+#define DEBOUNCE_VECT			TIM1_COMPA_vect
+#else
+#define DEBOUNCE_VECT			TIM0_COMPA_vect
+#endif
+
+#if defined(DEBOUNCE_ADAPTIVE) || defined(DEBOUNCE_DIAGNOSTICS)
+#define TRACK_BOUNCE
+#endif
+
+#ifdef DEBOUNCE_ADAPTIVE
+#if DEBOUNCE_ADAPTIVE_MAX > DEBOUNCE_COUNT_SHORT
+#error DEBOUNCE_ADAPTIVE_MAX can not be more than DEBOUNCE_COUNT_SHORT
+#endif
+#if DEBOUNCE_ADAPTIVE_MIN < 1 || DEBOUNCE_ADAPTIVE_MIN > DEBOUNCE_ADAPTIVE_MAX
+#error DEBOUNCE_ADAPTIVE_MIN out of range
+#endif
+#endif
+
+#define LADDER_NO_BUTTON		0xff
+#define PIN_INVALID				0xff
+
 /*********************************************************************
  * File global variables
  *********************************************************************/
@@ -33,11 +79,109 @@ struct button {
 	uint8_t long_press;
 	uint8_t auto_acknowledge;
 	uint8_t dead_time_counter;
+#ifdef BUTTON_TYPES
+	uint8_t type;
+#endif
+#ifdef DEBOUNCE_CHORDS
+	uint8_t mask;			// Own bit, or member bits for a chord
+	uint8_t suppressed;		// Part of a detected chord, wait for release
+	uint8_t chord_window;		// Chords only: simultaneity window
+	uint8_t chord_timer;		// Chords only: slices since first member down
+#endif
+#ifdef DEBOUNCE_ADAPTIVE
+	uint8_t window;			// Current short press window
+	uint16_t bounce_estimate;	// Running estimate, 4 fractional bits
+#endif
+#ifdef TRACK_BOUNCE
+	uint8_t bounce_counter;		// Slices since the press was first seen
+	uint8_t last_bounce;		// Last slice the line read released
+#endif
+#ifdef DEBOUNCE_DIAGNOSTICS
+	uint8_t was_pressed;		// Line state while not acknowledged
+	debounce_stats_t stats;
+#endif
 	
 };
 
 struct button *button_list_head = NULL;
 
+// Number of 10ms slices since the timer was started
+static volatile uint32_t tick_count = 0;
+
+// Set once init_timer has run
+static uint8_t timer_started = 0;
+
+#ifdef DEBOUNCE_CHORDS
+static uint8_t next_button_mask = 1;
+
+// Rebuilt on every Timer0 interrupt. Raw: pin reads pressed now.
+// Down: pressed at the short press sample and not yet classified.
+static uint8_t raw_state;
+static uint8_t down_state;
+#endif
+
+#ifdef DEBOUNCE_ADC_LADDER
+// ADC channel for each PORTB pin, LADDER_NO_BUTTON if none
+static const uint8_t ladder_adc_channel[6] = {
+	LADDER_NO_BUTTON, LADDER_NO_BUTTON, 1, 3, 2, 0
+};
+
+static uint8_t ladder_thresholds[DEBOUNCE_LADDER_MAX_BUTTONS];
+static uint8_t ladder_num_buttons = 0;
+static volatile uint8_t ladder_pressed = LADDER_NO_BUTTON;
+#endif
+
+#ifdef DEBOUNCE_TRACE
+#if (DEBOUNCE_TRACE_SIZE & (DEBOUNCE_TRACE_SIZE - 1)) || DEBOUNCE_TRACE_SIZE > 256
+#error DEBOUNCE_TRACE_SIZE must be a power of two, at most 256
+#endif
+
+#define TRACE_MASK		(DEBOUNCE_TRACE_SIZE - 1)
+
+// Completed runs. Written by the Timer0 interrupt only, read by 
+// debounce_trace_read only: same lock free single producer, single
+// consumer ring as libserial
+static debounce_trace_t trace_ring[DEBOUNCE_TRACE_SIZE];
+static volatile uint8_t trace_head = 0;
+static volatile uint8_t trace_tail = 0;
+
+// Run in progress, Timer0 interrupt only while capturing
+static uint8_t trace_pins;
+static uint8_t trace_length = 0;
+
+static uint8_t trace_mask = 0;
+static volatile uint8_t trace_status = 0;
+#endif
+
+#ifdef DEBOUNCE_ENCODER
+struct encoder {
+
+	struct encoder *next;
+	uint8_t mask_a;
+	uint8_t mask_b;
+	uint8_t state;			// Last A/B state, A in bit 1, B in bit 0
+	volatile int16_t position;
+	int16_t delta_base;		// Position at last encoder_read_delta
+#ifdef DEBOUNCE_ENCODER_VELOCITY
+	int16_t tick_position;		// Position at last 10ms slice
+	volatile int8_t velocity;
+#endif
+	struct button *button;
+
+};
+
+struct encoder *encoder_list_head = NULL;
+
+// Quadrature state table, indexed by (old state << 2) | new state.
+// Invalid transitions (both lines changed) count as no movement.
+static const int8_t encoder_table[16] PROGMEM = {
+	 0, -1,  1,  0,
+	 1,  0,  0, -1,
+	-1,  0,  0,  1,
+	 0,  1, -1,  0
+};
+#endif
+
 /*********************************************************************
  * Private functions
  *********************************************************************/
@@ -48,11 +192,31 @@ struct button *button_list_head = NULL;
  * Timer0 runs in CTC mode with a /1024 prescaler and counts to
  * F_CPU / 10000
  * This results in ISR every 10ms, which will be used to debounce
+ *
+ * Called by everything that needs the tick. Only the first call
+ * sets the timer up.
  ******************************************************************/
 
 static void init_timer(void) 
 {
 
+	if (timer_started)
+		return;
+	timer_started = 1;
+
+#if defined(DEBOUNCE_SERIAL_TICK)
+	// libserial's Timer1 interrupt calls debounce_tick
+#elif defined(DEBOUNCE_TIMER1)
+	// CTC mode, clear on reaching OCR1C. Compare A fires at the same count
+	TCCR1 = (1 << CTC1);
+	OCR1A = OCR1C = OCR1_VALUE;
+
+	// Enable Compare Match interrupt
+	TIMSK |= (1 << OCIE1A);
+
+	// Start timer with prescaler /1024
+	TCCR1 |= (1 << CS13 | 1 << CS11 | 1 << CS10);
+#else
 	// CTC mode
 	TCCR0A &= ~(1 << WGM00);
 	TCCR0A |= (1 << WGM01);
@@ -66,25 +230,47 @@ static void init_timer(void)
 	// Start timer with prescaler /1024
 	TCCR0B |= (1 << CS02 | 1 << CS00);
 	TCCR0B &= ~(1 << CS01);
+#endif
 
 }
 
-static return_code_t setup_io(char *button_pin, struct button *button)
+/******************************************************************
+ * parse_pin: turn a pin name like "PB0" into a pin number
+ *
+ * Returns PIN_INVALID if the name does not make sense
+ ******************************************************************/
+
+static uint8_t parse_pin(char *pin)
 {
 
 	// Sanity checks
-	if (strlen(button_pin) != 3)
-		return RETURN_ERROR;
-	if (strstr(button_pin, "B") == NULL)
-		return RETURN_ERROR;
+	if (strlen(pin) != 3)
+		return PIN_INVALID;
+	if (strstr(pin, "B") == NULL)
+		return PIN_INVALID;
 
-	uint8_t pin_number = *(button_pin+2) - 0x30; // 0x30 = ASCII "0"
+	uint8_t pin_number = *(pin+2) - 0x30; // 0x30 = ASCII "0"
 	if (pin_number > 5)
+		return PIN_INVALID;
+
+	return pin_number;
+
+}
+
+static return_code_t setup_io(char *button_pin, struct button *button)
+{
+
+	uint8_t pin_number = parse_pin(button_pin);
+	if (pin_number == PIN_INVALID)
 		return RETURN_ERROR;
 
-	// Set port as input with pullup
-	DDRB &= ~(1 << pin_number);
-	PORTB |= (1 << pin_number);
+	// Set port as input with pullup. The pin is not known at compile
+	// time, so this is a read-modify-write: keep interrupts that write
+	// PORTB, like libserial's TX, out of it
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		DDRB &= ~(1 << pin_number);
+		PORTB |= (1 << pin_number);
+	}
 	
 	// Squirrel away data
 	button->port = &PINB;
@@ -128,6 +314,19 @@ static struct button *get_last_button(void)
 static uint8_t button_is_pressed(struct button *button)
 {
 
+#ifdef DEBOUNCE_ADC_LADDER
+	if (button->type == BUTTON_TYPE_LADDER)
+		return ladder_pressed == button->pin;
+#endif
+
+#ifdef DEBOUNCE_CHORDS
+	// A chord only runs the state machine once triggered, so it must 
+	// never start one by itself
+	if (button->type == BUTTON_TYPE_CHORD)
+		return button->current_debounce_count && 
+			(raw_state & button->mask) == button->mask;
+#endif
+
 	return bit_is_clear(*(button->port), button->pin);
 
 }
@@ -147,223 +346,1276 @@ static void add_button(struct button *button)
 	
 }
 
+static struct button *new_button(void)
+{
+
+	struct button *button;
+
+	if ((button = malloc(sizeof(struct button))) == NULL)
+		return NULL;
+
+	button->next = NULL;
+	button->port = NULL;
+	button->current_debounce_count = 0;
+	button->short_press = 0;
+	button->long_press = 0;
+	button->isr_short_press = 0;
+	button->auto_acknowledge = 0;
+	button->dead_time_counter = 0;
+#ifdef BUTTON_TYPES
+	button->type = BUTTON_TYPE_PIN;
+#endif
+#ifdef DEBOUNCE_CHORDS
+	button->mask = 0;
+	button->suppressed = 0;
+	button->chord_window = 0;
+	button->chord_timer = 0;
+#endif
+#ifdef DEBOUNCE_ADAPTIVE
+	button->window = DEBOUNCE_ADAPTIVE_MAX;
+	button->bounce_estimate = (uint16_t) DEBOUNCE_ADAPTIVE_MAX << 4;
+#endif
+#ifdef TRACK_BOUNCE
+	button->bounce_counter = 0;
+	button->last_bounce = 0;
+#endif
+#ifdef DEBOUNCE_DIAGNOSTICS
+	button->was_pressed = 0;
+	memset(&button->stats, 0, sizeof(debounce_stats_t));
+#endif
+
+	return button;
+
+}
+
+static void register_button(struct button *button)
+{
+
+#ifdef DEBOUNCE_CHORDS
+	// Only the first 8 buttons get a bit, others can't be in a chord
+	if (button->type != BUTTON_TYPE_CHORD) {
+		button->mask = next_button_mask;
+		next_button_mask <<= 1;
+	}
+#endif
+
+#ifdef DEBOUNCE_TRACE
+	if (button->port == &PINB)
+		trace_mask |= (1 << button->pin);
+#endif
+
+	init_timer();
+
+	add_button(button);
+
+}
+
+#ifdef DEBOUNCE_ADC_LADDER
 /******************************************************************
- * Timer0 compare match interrupt: debounce button press
+ * init_adc: setup the ADC for the resistor ladder
  *
- * This function does all the actual work of the library. It gets
- * called regularly and checks each button
+ * Left adjusted result so ADCH is an 8 bit reading, VCC reference,
+ * /64 prescaler (125 kHz at 8 MHz). Conversions are started from
+ * the Timer0 interrupt and finish well within one 10ms slice.
  ******************************************************************/
 
-ISR(TIM0_COMPA_vect)
+static void init_adc(uint8_t channel)
 {
 
-	struct button *button = get_first_button();
+	ADMUX = (1 << ADLAR) | channel;
+	ADCSRA = (1 << ADEN | 1 << ADIE | 1 << ADPS2 | 1 << ADPS1);
 
-	while(button != NULL) {
+}
 
-		// Don't check this button if not acknowledged yet
-		if(button->short_press || button->long_press) {
-			button = get_next_button(button);
-			continue;
-		}		
+/******************************************************************
+ * ADC conversion complete interrupt: map reading to ladder button
+ ******************************************************************/
 
-		// Don't check this button if we are in dead time
-		if(button->dead_time_counter) {
-			button->dead_time_counter--;
-			button = get_next_button(button);
-			continue;
-		}
+ISR(ADC_vect)
+{
 
-		switch (button->current_debounce_count) {
+	uint8_t reading = ADCH;
+	uint8_t i;
 
-			// No previous presses detected
-			case 0:
-				if (button_is_pressed(button))
-					button->current_debounce_count = 1;
-				break;
+	for (i = 0; i < ladder_num_buttons; i++) {
+		if (reading <= ladder_thresholds[i]) {
+			ladder_pressed = i;
+			return;
+		}
+	}
 
-			// Possible short press
-			case DEBOUNCE_COUNT_SHORT:
-				if (button_is_pressed(button))
-					button->isr_short_press = 1;
-				button->current_debounce_count++;
-				break;
+	ladder_pressed = LADDER_NO_BUTTON;
 
-			// Halfway between possible short and long press
-			case DEBOUNCE_COUNT_MID:
-				if (button->isr_short_press && ! button_is_pressed(button)) {
-					// It's a short press
-					button->short_press = 1;
-					button->dead_time_counter = DEBOUNCE_DEAD_TIME_SHORT;
-					button->isr_short_press = 0;
-					button->current_debounce_count = 0;
-				} else {
-					// Button still pressed - it could be long
-					button->current_debounce_count++;
-				}
-				break;
+}
+#endif
 
-			// Possible long press
-			case DEBOUNCE_COUNT_LONG:
-				if (button_is_pressed(button)) {
-					// It's a long press
-					button->long_press = 1;
-					button->dead_time_counter = DEBOUNCE_DEAD_TIME_LONG;
-				} else if (button->isr_short_press) {
-					// It was a short press after all
-					button->short_press = 1;
-					button->dead_time_counter = DEBOUNCE_DEAD_TIME_SHORT;
-				}
-				button->current_debounce_count = 0;
-				button->isr_short_press = 0;
-				break;
+#ifdef DEBOUNCE_ENCODER
+/******************************************************************
+ * read_encoder_state: get the current A/B state of an encoder
+ *
+ * Both lines are active low, the state returned is active high
+ * with A in bit 1 and B in bit 0
+ ******************************************************************/
 
-			// All other cases, i.e. > 0 and < LONG_PRESS and not already covered
-			default:
-				button->current_debounce_count++;
-				break;
+static uint8_t read_encoder_state(struct encoder *encoder, uint8_t pins)
+{
 
-		}
+	uint8_t state = 0;
 
-		button = get_next_button(button);
+	if (!(pins & encoder->mask_a))
+		state |= 2;
+	if (!(pins & encoder->mask_b))
+		state |= 1;
 
-	}
+	return state;
 
 }
 
-/*********************************************************************
- * Public functions
- *********************************************************************/
-
-/*********************************************************************
- * debounce_init: setup a button for debouncing
- *
- * Parameters
- *		char * button_pin
- *			Pin the button is connected to. Use standard
- *			AVR naming, e.g. "PB0"
- * Returns
- *		button_t button
- *			Opaque data structure to be used in further
- *			calls in this library
- * 
- * This library expects the button to pull the pin to GND. 
+/******************************************************************
+ * Pin change interrupt: decode quadrature encoders
  *
- * This function will setup the I/O direction & pull up resistor for
- * the pin and then start watching the pin for button presses
- *********************************************************************/
+ * All encoders are updated from one snapshot of PINB. With
+ * DEBOUNCE_SHARED_PCINT this is a plain function, called from an
+ * application ISR that also serves other pins.
+ ******************************************************************/
 
-extern button_t debounce_init(char *pin)
+#ifdef DEBOUNCE_SHARED_PCINT
+extern void debounce_pin_change(void)
+#else
+ISR(PCINT0_vect)
+#endif
 {
-	
-	struct button *button;
-
 
-	// Set up new button data 
-	if ((button = malloc(sizeof(struct button))) == NULL)
-		return NULL;
+	uint8_t pins = PINB;
+	uint8_t state;
+	struct encoder *encoder = encoder_list_head;
 
-	button->next = NULL;
-	button->port = NULL;
-	button->current_debounce_count = 0;
-	button->short_press = 0;
-	button->long_press = 0;
-	button->isr_short_press = 0;
-	button->auto_acknowledge = 0;
-	button->dead_time_counter = 0;
+	while (encoder != NULL) {
 
-	// Setup io for button
-	if (setup_io(pin, button) == RETURN_ERROR) 
-		return NULL;
+		state = read_encoder_state(encoder, pins);
+		encoder->position += (int8_t) pgm_read_byte(
+				&encoder_table[(encoder->state << 2) | state]
+			);
+		encoder->state = state;
 
-	// Start timer if necessary
-	if (button_list_head == NULL)
-		init_timer();
+		encoder = encoder->next;
 
-	// Register button
-	add_button(button);
-	
-	// Chocks away
-	return (button_t) button;
+	}
 
 }
 
-/*********************************************************************
- * button_check: check whether a button has been pressed
- *
- * Parameters:
- * 		button_t button
- * 			The button to check
- * Returns:
- *		button_press_t result: 
- *			One of BUTTON_PRESS_NONE, BUTTON_PRESS_SHORT or 
- *			BUTTON_PRESS_LONG
+#ifdef DEBOUNCE_ENCODER_VELOCITY
+/******************************************************************
+ * update_encoder_velocity: work out movement per 10ms slice
  *
- * This function will, apart from returning the button state, also
- * acknowledge a button press if auto_acknowledge_button was set
- *********************************************************************/
+ * Called from the Timer0 interrupt. With DEBOUNCE_SERIAL_TICK
+ * the pin change interrupt can come in meanwhile, so position is
+ * read with interrupts off.
+ ******************************************************************/
 
-extern button_press_t button_check(button_t param)
+static void update_encoder_velocity(void)
 {
 
-	struct button *button = (struct button *) param;
+	struct encoder *encoder = encoder_list_head;
+	int16_t position;
+	int16_t velocity;
 
-	button_press_t result = BUTTON_PRESS_NONE;
+	while (encoder != NULL) {
 
-	if (button->short_press) {
-		result = BUTTON_PRESS_SHORT;
-		if (button->auto_acknowledge)
-			button->short_press = 0;
-	}
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			position = encoder->position;
+		}
+		velocity = position - encoder->tick_position;
+		encoder->tick_position = position;
 
-	if (button->long_press) {
-		result = BUTTON_PRESS_LONG;
-		if (button->auto_acknowledge)
-			button->long_press = 0;
-	}
+		if (velocity > 127)
+			velocity = 127;
+		if (velocity < -128)
+			velocity = -128;
+		encoder->velocity = velocity;
 
-	return result;
+		encoder = encoder->next;
+
+	}
 
 }
+#endif
+#endif
 
-/*********************************************************************
- * button_acknowledge: acknowledge that you read the button status
- *
- * Parameters:
- * 		button_t button
- * 			The button to acknowledge
+#ifdef DEBOUNCE_CHORDS
+/******************************************************************
+ * suppress_chord_members: hand a chord's presses over to the chord
  *
- * This function will acknowledge a button press. While a button press
- * is not acknowledged, the library will not check its status, so this
- * acts as a lock on the button. If auto_acknowledge_button was set,
- * this need not be called explicitely
- *********************************************************************/
+ * Resets the state machine of all member buttons, so they do not
+ * report the presses that made up the chord, and keeps them quiet
+ * until released.
+ ******************************************************************/
 
-extern void button_acknowledge(button_t param)
+static void suppress_chord_members(struct button *chord)
 {
-	
-	struct button *button = (struct button *) param;
-	button->short_press = 0;
-	button->long_press = 0;
+
+	struct button *button = get_first_button();
+
+	while (button != NULL) {
+
+		if (button->type != BUTTON_TYPE_CHORD && 
+			(button->mask & chord->mask)) {
+
+			button->current_debounce_count = 0;
+			button->isr_short_press = 0;
+			button->suppressed = 1;
+
+		}
+
+		button = get_next_button(button);
+
+	}
 
 }
 
-/*********************************************************************
- * button_auto_acknowledge: set a button to auto-acknowledge checks
- *
- * Parameters:
- * 		button_t button
- * 			The button to auto acknowledge
+/******************************************************************
+ * check_chord: see whether a chord's members all went down together
  *
- * This will set up the button to auto acknowledge checks. When 
- * button_check is called for a button with auto_acknowledge set, that
- * will immediately acknowledge the button
- *********************************************************************/
+ * Members must all reach the short press sample within chord_window
+ * slices of the first one. The chord then takes over as if it had 
+ * just passed its own short press sample.
+ ******************************************************************/
 
-extern void button_auto_acknowledge(button_t param)
+static void check_chord(struct button *chord)
 {
 
-	struct button *button = (struct button *) param;
+	uint8_t members_down = down_state & chord->mask;
+
+	// Already triggered, state machine takes it from here
+	if (chord->current_debounce_count)
+		return;
+
+	if (members_down == 0) {
+		chord->chord_timer = 0;
+		return;
+	}
+
+	if (chord->chord_timer == CHORD_DISARMED)
+		return;
+
+	if (members_down == chord->mask) {
+
+		suppress_chord_members(chord);
+		chord->isr_short_press = 1;
+		chord->current_debounce_count = DEBOUNCE_COUNT_SHORT + 1;
+		chord->chord_timer = 0;
+
+	} else if (++(chord->chord_timer) > chord->chord_window) {
+
+		// Too slow. Wait until all members are released again
+		chord->chord_timer = CHORD_DISARMED;
+
+	}
+
+}
+#endif
+
+#ifdef TRACK_BOUNCE
+/******************************************************************
+ * track_bounce: note whether the line bounced during this slice
+ *
+ * Called every slice between the press being first seen and the
+ * short press sample, and on to the mid sample if the press was
+ * rejected at the short sample
+ ******************************************************************/
+
+static void track_bounce(struct button *button)
+{
+
+	button->bounce_counter++;
+	if (!button_is_pressed(button))
+		button->last_bounce = button->bounce_counter;
+
+}
+#endif
+
+#ifdef DEBOUNCE_DIAGNOSTICS
+/******************************************************************
+ * count_event: increment a diagnostics counter, saturating
+ ******************************************************************/
+
+static void count_event(uint16_t *counter)
+{
+
+	if (*counter != UINT16_MAX)
+		(*counter)++;
+
+}
+
+/******************************************************************
+ * note_dropped_press: count presses while not acknowledged
+ *
+ * These presses are lost, as the state machine does not run until
+ * the previous press is acknowledged
+ ******************************************************************/
+
+static void note_dropped_press(struct button *button)
+{
+
+	uint8_t pressed = button_is_pressed(button);
+
+	if (pressed && !button->was_pressed)
+		count_event(&button->stats.dropped);
+	button->was_pressed = pressed;
+
+}
+#endif
+
+#ifdef DEBOUNCE_EVENTS
+extern uint8_t DEBOUNCE_EVENT_HANDLER(button_t, button_press_t);
+
+/******************************************************************
+ * offer_press: hand a press just classified to the event handler
+ *
+ * If the handler takes it, it is acknowledged at once. Dead time
+ * still runs as usual.
+ ******************************************************************/
+
+static void offer_press(struct button *button, button_press_t press)
+{
+
+	if (DEBOUNCE_EVENT_HANDLER((button_t) button, press)) {
+		button->short_press = 0;
+		button->long_press = 0;
+	}
+
+}
+#endif
+
+#ifdef DEBOUNCE_ADAPTIVE
+/******************************************************************
+ * adapt_window: fold the last bounce time into the estimate
+ *
+ * Exponential moving average with a weight of 1/4 on the new value.
+ * The window is the estimate rounded up, plus the margin.
+ ******************************************************************/
+
+static void adapt_window(struct button *button)
+{
+
+	int16_t estimate = button->bounce_estimate;
+	int16_t window;
+
+	estimate += (((int16_t) button->last_bounce << 4) - estimate) / 4;
+	button->bounce_estimate = estimate;
+
+	window = ((estimate + 15) >> 4) + DEBOUNCE_ADAPTIVE_MARGIN;
+	if (window < DEBOUNCE_ADAPTIVE_MIN)
+		window = DEBOUNCE_ADAPTIVE_MIN;
+	if (window > DEBOUNCE_ADAPTIVE_MAX)
+		window = DEBOUNCE_ADAPTIVE_MAX;
+	button->window = window;
+
+}
+
+/******************************************************************
+ * widen_window: learn from a press rejected at the short sample
+ *
+ * Called at the mid sample. If the line has settled pressed by
+ * then, the contact bounced for last_bounce slices, measured past
+ * the window. If not, all we know is it bounced for the whole
+ * window. Either is at least the window, i.e. the estimate plus the
+ * margin, so the estimate and the window move up towards
+ * DEBOUNCE_ADAPTIVE_MAX.
+ ******************************************************************/
+
+static void widen_window(struct button *button)
+{
+
+	if (!button_is_pressed(button))
+		button->last_bounce = button->window;
+	adapt_window(button);
+
+}
+#endif
+
+#ifdef DEBOUNCE_TRACE
+/******************************************************************
+ * trace_push: close the run in progress
+ *
+ * Returns 0 if the ring is full
+ ******************************************************************/
+
+static uint8_t trace_push(void)
+{
+
+	uint8_t head = trace_head;
+	uint8_t next = (head + 1) & TRACE_MASK;
+
+	if (next == trace_tail)
+		return 0;
+
+	trace_ring[head].pins = trace_pins;
+	trace_ring[head].length = trace_length;
+	trace_head = next;	// Publish only after the entry is in
+	trace_length = 0;
+
+	return 1;
+
+}
+
+/******************************************************************
+ * trace_sample: add this slice's pin state to the capture
+ *
+ * Called from the Timer0 interrupt while capturing. A run ends
+ * when the pins change or its length counter is full. If it can
+ * not be stored, the capture stops there, so what was captured
+ * has no gaps.
+ ******************************************************************/
+
+static void trace_sample(void)
+{
+
+	uint8_t pins = PINB & trace_mask;
+
+	if (trace_length && (pins != trace_pins || trace_length == 0xff)) {
+		if (!trace_push()) {
+			trace_status = DEBOUNCE_TRACE_OVERFLOW;
+			return;
+		}
+	}
+
+	trace_pins = pins;
+	trace_length++;
+
+}
+#endif
+
+/******************************************************************
+ * Timer0 compare match interrupt: debounce button press
+ *
+ * This function does all the actual work of the library. It gets
+ * called regularly and checks each button. With 
+ * DEBOUNCE_SERIAL_TICK it is debounce_tick, called from libserial's
+ * Timer1 interrupt instead.
+ ******************************************************************/
+
+#ifdef DEBOUNCE_SERIAL_TICK
+extern void debounce_tick(void)
+#else
+ISR(DEBOUNCE_VECT)
+#endif
+{
+
+	struct button *button = get_first_button();
+
+	tick_count++;
+
+#ifdef DEBOUNCE_TRACE
+	if (trace_status == DEBOUNCE_TRACE_RUNNING)
+		trace_sample();
+#endif
+
+#ifdef DEBOUNCE_ADC_LADDER
+	// Start next ladder conversion. Result is used next slice
+	if (ladder_num_buttons)
+		ADCSRA |= (1 << ADSC);
+#endif
+
+#ifdef DEBOUNCE_ENCODER_VELOCITY
+	update_encoder_velocity();
+#endif
+
+#ifdef DEBOUNCE_CHORDS
+	raw_state = 0;
+	down_state = 0;
+#endif
+
+	while(button != NULL) {
+
+#ifdef DEBOUNCE_CHORDS
+		// Members come before their chords in the list, so both 
+		// states are complete by the time we get to a chord
+		if (button->type == BUTTON_TYPE_CHORD) {
+			if (!(button->short_press || button->long_press || 
+				button->dead_time_counter))
+				check_chord(button);
+		} else if (button_is_pressed(button)) {
+			raw_state |= button->mask;
+		}
+
+		// Keep chord members quiet until released
+		if (button->suppressed) {
+			if (!(raw_state & button->mask)) {
+				button->suppressed = 0;
+				button->dead_time_counter = DEBOUNCE_DEAD_TIME_SHORT;
+			}
+			button = get_next_button(button);
+			continue;
+		}
+#endif
+
+		// Don't check this button if not acknowledged yet
+		if(button->short_press || button->long_press) {
+#ifdef DEBOUNCE_DIAGNOSTICS
+			note_dropped_press(button);
+#endif
+			button = get_next_button(button);
+			continue;
+		}		
+
+		// Don't check this button if we are in dead time
+		if(button->dead_time_counter) {
+			button->dead_time_counter--;
+			button = get_next_button(button);
+			continue;
+		}
+
+		switch (button->current_debounce_count) {
+
+			// No previous presses detected
+			case 0:
+				if (button_is_pressed(button)) {
+#ifdef DEBOUNCE_ADAPTIVE
+					// Start closer to the short press sample
+					// for a shorter window
+					button->current_debounce_count = 
+						DEBOUNCE_COUNT_SHORT - button->window + 1;
+#else
+					button->current_debounce_count = 1;
+#endif
+#ifdef TRACK_BOUNCE
+					button->bounce_counter = 0;
+					button->last_bounce = 0;
+#endif
+				}
+				break;
+
+			// Possible short press
+			case DEBOUNCE_COUNT_SHORT:
+				if (button_is_pressed(button)) {
+					button->isr_short_press = 1;
+#ifdef DEBOUNCE_ADAPTIVE
+					adapt_window(button);
+#endif
+#ifdef DEBOUNCE_DIAGNOSTICS
+					if (button->last_bounce > button->stats.max_bounce)
+						button->stats.max_bounce = button->last_bounce;
+#endif
+				} else {
+#ifdef TRACK_BOUNCE
+					// Still bouncing at the end of the window.
+					// Keep measuring up to the mid sample
+					track_bounce(button);
+#endif
+#ifdef DEBOUNCE_DIAGNOSTICS
+					count_event(&button->stats.glitches);
+#endif
+				}
+				button->current_debounce_count++;
+				break;
+
+			// Halfway between possible short and long press
+			case DEBOUNCE_COUNT_MID:
+				if (button->isr_short_press && ! button_is_pressed(button)) {
+					// It's a short press
+					button->short_press = 1;
+#ifdef DEBOUNCE_DIAGNOSTICS
+					count_event(&button->stats.short_presses);
+					button->was_pressed = 0;
+#endif
+					button->dead_time_counter = DEBOUNCE_DEAD_TIME_SHORT;
+					button->isr_short_press = 0;
+					button->current_debounce_count = 0;
+#ifdef DEBOUNCE_EVENTS
+					offer_press(button, BUTTON_PRESS_SHORT);
+#endif
+				} else {
+#ifdef DEBOUNCE_ADAPTIVE
+					if (!button->isr_short_press)
+						widen_window(button);
+#endif
+					// Button still pressed - it could be long
+					button->current_debounce_count++;
+				}
+				break;
+
+			// Possible long press
+			case DEBOUNCE_COUNT_LONG:
+				if (button_is_pressed(button)) {
+					// It's a long press
+					button->long_press = 1;
+#ifdef DEBOUNCE_DIAGNOSTICS
+					count_event(&button->stats.long_presses);
+					button->was_pressed = 1;
+#endif
+					button->dead_time_counter = DEBOUNCE_DEAD_TIME_LONG;
+#ifdef DEBOUNCE_EVENTS
+					offer_press(button, BUTTON_PRESS_LONG);
+#endif
+				} else if (button->isr_short_press) {
+					// It was a short press after all
+					button->short_press = 1;
+#ifdef DEBOUNCE_DIAGNOSTICS
+					count_event(&button->stats.short_presses);
+					button->was_pressed = 0;
+#endif
+					button->dead_time_counter = DEBOUNCE_DEAD_TIME_SHORT;
+#ifdef DEBOUNCE_EVENTS
+					offer_press(button, BUTTON_PRESS_SHORT);
+#endif
+				}
+				button->current_debounce_count = 0;
+				button->isr_short_press = 0;
+				break;
+
+			// All other cases, i.e. > 0 and < LONG_PRESS and not already covered
+			default:
+#ifdef TRACK_BOUNCE
+				if (button->current_debounce_count < DEBOUNCE_COUNT_SHORT ||
+					(button->current_debounce_count < DEBOUNCE_COUNT_MID &&
+					!button->isr_short_press))
+					track_bounce(button);
+#endif
+				button->current_debounce_count++;
+				break;
+
+		}
+
+#ifdef DEBOUNCE_CHORDS
+		if (button->isr_short_press)
+			down_state |= button->mask;
+#endif
+
+		button = get_next_button(button);
+
+	}
+
+}
+
+/*********************************************************************
+ * Public functions
+ *********************************************************************/
+
+/*********************************************************************
+ * debounce_init: setup a button for debouncing
+ *
+ * Parameters
+ *		char * button_pin
+ *			Pin the button is connected to. Use standard
+ *			AVR naming, e.g. "PB0"
+ * Returns
+ *		button_t button
+ *			Opaque data structure to be used in further
+ *			calls in this library
+ * 
+ * This library expects the button to pull the pin to GND. 
+ *
+ * This function will setup the I/O direction & pull up resistor for
+ * the pin and then start watching the pin for button presses
+ *********************************************************************/
+
+extern button_t debounce_init(char *pin)
+{
+	
+	struct button *button;
+
+
+	// Set up new button data 
+	if ((button = new_button()) == NULL)
+		return NULL;
+
+	// Setup io for button
+	if (setup_io(pin, button) == RETURN_ERROR) {
+		free(button);
+		return NULL;
+	}
+
+	// Register button
+	register_button(button);
+	
+	// Chocks away
+	return (button_t) button;
+
+}
+
+#ifdef DEBOUNCE_ADC_LADDER
+/*********************************************************************
+ * debounce_ladder_init: setup a resistor ladder on an ADC pin
+ *
+ * Parameters
+ *		char * ladder_pin
+ *			ADC capable pin the ladder is connected to, e.g.
+ *			"PB3"
+ *		const uint8_t * thresholds
+ *			Calibrated threshold table, one entry per button,
+ *			in ascending order
+ *		uint8_t num_buttons
+ *			Number of entries in thresholds
+ * Returns
+ *		uint8_t result
+ *			1 on success, 0 on error
+ *********************************************************************/
+
+extern uint8_t debounce_ladder_init(
+				char *pin,
+				const uint8_t *thresholds,
+				uint8_t num_buttons
+				)
+{
+
+	uint8_t pin_number;
+	uint8_t channel;
+	uint8_t i;
+
+	// Sanity checks
+	if (num_buttons == 0 || num_buttons > DEBOUNCE_LADDER_MAX_BUTTONS)
+		return 0;
+
+	pin_number = parse_pin(pin);
+	if (pin_number == PIN_INVALID)
+		return 0;
+
+	channel = ladder_adc_channel[pin_number];
+	if (channel == LADDER_NO_BUTTON)
+		return 0;
+
+	for (i = 0; i < num_buttons; i++)
+		ladder_thresholds[i] = thresholds[i];
+
+	// Input, no pullup (the ladder provides it), digital input off
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		DDRB &= ~(1 << pin_number);
+		PORTB &= ~(1 << pin_number);
+	}
+	DIDR0 |= (1 << pin_number); // Bit positions match pin numbers
+
+	init_adc(channel);
+
+	// Setting this enables conversions from the timer interrupt
+	ladder_num_buttons = num_buttons;
+
+	return 1;
+
+}
+
+/*********************************************************************
+ * debounce_init_ladder: setup a ladder button for debouncing
+ *
+ * Parameters
+ *		uint8_t button_index
+ *			Index of the button in the threshold table passed
+ *			to debounce_ladder_init
+ * Returns
+ *		button_t button
+ *			Opaque data structure to be used in further
+ *			calls in this library, or NULL on error
+ *********************************************************************/
+
+extern button_t debounce_init_ladder(uint8_t button_index)
+{
+
+	struct button *button;
+
+	if (button_index >= ladder_num_buttons)
+		return NULL;
+
+	if ((button = new_button()) == NULL)
+		return NULL;
+
+	button->type = BUTTON_TYPE_LADDER;
+	button->pin = button_index;
+
+	register_button(button);
+
+	return (button_t) button;
+
+}
+#endif
+
+/*********************************************************************
+ * button_check: check whether a button has been pressed
+ *
+ * Parameters:
+ * 		button_t button
+ * 			The button to check
+ * Returns:
+ *		button_press_t result: 
+ *			One of BUTTON_PRESS_NONE, BUTTON_PRESS_SHORT or 
+ *			BUTTON_PRESS_LONG
+ *
+ * This function will, apart from returning the button state, also
+ * acknowledge a button press if auto_acknowledge_button was set
+ *********************************************************************/
+
+extern button_press_t button_check(button_t param)
+{
+
+	struct button *button = (struct button *) param;
+
+	button_press_t result = BUTTON_PRESS_NONE;
+
+	if (button->short_press) {
+		result = BUTTON_PRESS_SHORT;
+		if (button->auto_acknowledge)
+			button->short_press = 0;
+	}
+
+	if (button->long_press) {
+		result = BUTTON_PRESS_LONG;
+		if (button->auto_acknowledge)
+			button->long_press = 0;
+	}
+
+	return result;
+
+}
+
+/*********************************************************************
+ * button_acknowledge: acknowledge that you read the button status
+ *
+ * Parameters:
+ * 		button_t button
+ * 			The button to acknowledge
+ *
+ * This function will acknowledge a button press. While a button press
+ * is not acknowledged, the library will not check its status, so this
+ * acts as a lock on the button. If auto_acknowledge_button was set,
+ * this need not be called explicitely
+ *********************************************************************/
+
+extern void button_acknowledge(button_t param)
+{
+	
+	struct button *button = (struct button *) param;
+	button->short_press = 0;
+	button->long_press = 0;
+
+}
+
+/*********************************************************************
+ * button_auto_acknowledge: set a button to auto-acknowledge checks
+ *
+ * Parameters:
+ * 		button_t button
+ * 			The button to auto acknowledge
+ *
+ * This will set up the button to auto acknowledge checks. When 
+ * button_check is called for a button with auto_acknowledge set, that
+ * will immediately acknowledge the button
+ *********************************************************************/
+
+extern void button_auto_acknowledge(button_t param)
+{
+
+	struct button *button = (struct button *) param;
 	button->auto_acknowledge = 1;
 
 }
+
+/*********************************************************************
+ * debounce_ticks: get the debounce time base
+ *
+ * Returns:
+ *		uint32_t ticks
+ *			Number of 10ms slices since the first button was
+ *			set up. Wraps around after some 497 days.
+ *********************************************************************/
+
+extern uint32_t debounce_ticks(void)
+{
+
+	uint32_t ticks;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ticks = tick_count;
+	}
+
+	return ticks;
+
+}
+
+#ifdef DEBOUNCE_ENCODER
+/*********************************************************************
+ * debounce_init_encoder: setup a rotary encoder
+ *
+ * Parameters
+ *		char * pin_a
+ *		char * pin_b
+ *			Pins the A and B outputs are connected to, e.g. 
+ *			"PB3"
+ *		char * switch_pin
+ *			Pin the push switch is connected to, or NULL
+ * Returns
+ *		encoder_t encoder
+ *			Opaque data structure to be used in further
+ *			calls in this library, or NULL on error
+ *********************************************************************/
+
+extern encoder_t debounce_init_encoder(
+				char *pin_a,
+				char *pin_b,
+				char *switch_pin
+				)
+{
+
+	struct encoder *encoder;
+	uint8_t pin_number_a = parse_pin(pin_a);
+	uint8_t pin_number_b = parse_pin(pin_b);
+
+	// Sanity checks
+	if (pin_number_a == PIN_INVALID || pin_number_b == PIN_INVALID)
+		return NULL;
+	if (pin_number_a == pin_number_b)
+		return NULL;
+
+	if ((encoder = malloc(sizeof(struct encoder))) == NULL)
+		return NULL;
+
+	encoder->button = NULL;
+	if (switch_pin != NULL) {
+		if ((encoder->button = debounce_init(switch_pin)) == NULL) {
+			free(encoder);
+			return NULL;
+		}
+	}
+
+	encoder->mask_a = (1 << pin_number_a);
+	encoder->mask_b = (1 << pin_number_b);
+#ifdef DEBOUNCE_TRACE
+	trace_mask |= encoder->mask_a | encoder->mask_b;
+#endif
+	encoder->position = 0;
+	encoder->delta_base = 0;
+#ifdef DEBOUNCE_ENCODER_VELOCITY
+	encoder->tick_position = 0;
+	encoder->velocity = 0;
+#endif
+
+	// Inputs with pullup
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		DDRB &= ~(encoder->mask_a | encoder->mask_b);
+		PORTB |= (encoder->mask_a | encoder->mask_b);
+	}
+
+	encoder->state = read_encoder_state(encoder, PINB);
+
+	// Register encoder. Prepending is fine, order does not matter
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		encoder->next = encoder_list_head;
+		encoder_list_head = encoder;
+	}
+
+	// Pin change interrupt on A & B. Bit positions in PCMSK match pin numbers
+	PCMSK |= (encoder->mask_a | encoder->mask_b);
+	GIMSK |= (1 << PCIE);
+
+#ifdef DEBOUNCE_ENCODER_VELOCITY
+	// Velocity is worked out in the timer interrupt
+	init_timer();
+#endif
+
+	return (encoder_t) encoder;
+
+}
+
+/*********************************************************************
+ * encoder_position: get the current encoder position
+ *
+ * Parameters:
+ * 		encoder_t encoder
+ * Returns:
+ *		int16_t position
+ *			Signed position in quadrature counts since init
+ *********************************************************************/
+
+extern int16_t encoder_position(encoder_t param)
+{
+
+	struct encoder *encoder = (struct encoder *) param;
+	int16_t position;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		position = encoder->position;
+	}
+
+	return position;
+
+}
+
+/*********************************************************************
+ * encoder_read_delta: get and clear the movement since last call
+ *
+ * Parameters:
+ * 		encoder_t encoder
+ * Returns:
+ *		int16_t delta
+ *			Signed movement in quadrature counts since the
+ *			previous call
+ *********************************************************************/
+
+extern int16_t encoder_read_delta(encoder_t param)
+{
+
+	struct encoder *encoder = (struct encoder *) param;
+	int16_t position = encoder_position(param);
+	int16_t delta = position - encoder->delta_base;
+
+	encoder->delta_base = position;
+
+	return delta;
+
+}
+
+#ifdef DEBOUNCE_ENCODER_VELOCITY
+/*********************************************************************
+ * encoder_velocity: get the encoder speed
+ *
+ * Parameters:
+ * 		encoder_t encoder
+ * Returns:
+ *		int8_t velocity
+ *			Movement in quadrature counts during the last
+ *			10ms slice
+ *********************************************************************/
+
+extern int8_t encoder_velocity(encoder_t param)
+{
+
+	struct encoder *encoder = (struct encoder *) param;
+	return encoder->velocity;
+
+}
+#endif
+
+/*********************************************************************
+ * encoder_button: get the push switch of an encoder
+ *
+ * Parameters:
+ * 		encoder_t encoder
+ * Returns:
+ *		button_t button
+ *			The push switch, or NULL if the encoder has none
+ *********************************************************************/
+
+extern button_t encoder_button(encoder_t param)
+{
+
+	struct encoder *encoder = (struct encoder *) param;
+	return (button_t) encoder->button;
+
+}
+#endif
+
+#ifdef DEBOUNCE_CHORDS
+/*********************************************************************
+ * button_mask: get the chord bit of a button
+ *
+ * Parameters:
+ * 		button_t button
+ * Returns:
+ *		uint8_t mask
+ *			Bit identifying the button in chord definitions, 
+ *			0 if the button can not be part of a chord
+ *********************************************************************/
+
+extern uint8_t button_mask(button_t param)
+{
+
+	struct button *button = (struct button *) param;
+	return button->mask;
+
+}
+
+/*********************************************************************
+ * debounce_init_chord: setup a multi-button chord
+ *
+ * Parameters
+ *		uint8_t mask
+ *			The member buttons, OR of button_mask() values
+ *		uint8_t window
+ *			Simultaneity window in 10ms slices
+ * Returns
+ *		button_t button
+ *			Opaque data structure to be used in further
+ *			calls in this library, or NULL on error
+ *********************************************************************/
+
+extern button_t debounce_init_chord(uint8_t mask, uint8_t window)
+{
+
+	struct button *button;
+	uint8_t assigned = next_button_mask ? next_button_mask - 1 : 0xff;
+
+	// Sanity check: at least two existing buttons
+	if ((mask & (mask - 1)) == 0 || (mask & ~assigned))
+		return NULL;
+
+	if ((button = new_button()) == NULL)
+		return NULL;
+
+	button->type = BUTTON_TYPE_CHORD;
+	button->mask = mask;
+	button->chord_window = window;
+
+	register_button(button);
+
+	return (button_t) button;
+
+}
+#endif
+
+#ifdef DEBOUNCE_ADAPTIVE
+/*********************************************************************
+ * button_debounce_window: get the current short press window
+ *
+ * Parameters:
+ * 		button_t button
+ * Returns:
+ *		uint8_t window
+ *			Number of 10ms slices a press needs to last before
+ *			it is sampled for a short press
+ *********************************************************************/
+
+extern uint8_t button_debounce_window(button_t param)
+{
+
+	struct button *button = (struct button *) param;
+	return button->window;
+
+}
+#endif
+
+#ifdef DEBOUNCE_DIAGNOSTICS
+/*********************************************************************
+ * debounce_diagnostics: get a snapshot of a button's statistics
+ *
+ * Parameters:
+ * 		button_t button
+ *		debounce_stats_t *stats
+ *			Where to put the snapshot
+ *********************************************************************/
+
+extern void debounce_diagnostics(button_t param, debounce_stats_t *stats)
+{
+
+	struct button *button = (struct button *) param;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*stats = button->stats;
+	}
+
+}
+
+/*********************************************************************
+ * debounce_diagnostics_reset: clear a button's statistics
+ *
+ * Parameters:
+ * 		button_t button
+ *********************************************************************/
+
+extern void debounce_diagnostics_reset(button_t param)
+{
+
+	struct button *button = (struct button *) param;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memset(&button->stats, 0, sizeof(debounce_stats_t));
+	}
+
+}
+#endif
+
+#ifdef DEBOUNCE_TRACE
+/*********************************************************************
+ * debounce_trace_start: start a trace capture
+ *
+ * Returns:
+ *		uint32_t tick
+ *			Tick of the first sample
+ *********************************************************************/
+
+extern uint32_t debounce_trace_start(void)
+{
+
+	uint32_t tick;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		trace_tail = trace_head;
+		trace_length = 0;
+		trace_status = DEBOUNCE_TRACE_RUNNING;
+		tick = tick_count + 1;	// First sample is on the next slice
+	}
+
+	return tick;
+
+}
+
+/*********************************************************************
+ * debounce_trace_stop: stop a trace capture
+ *
+ * With the interrupt held off, the run in progress can be closed 
+ * from here. If the ring is full, it is lost, like it would be had
+ * the capture gone on.
+ *********************************************************************/
+
+extern void debounce_trace_stop(void)
+{
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (trace_status == DEBOUNCE_TRACE_RUNNING) {
+			if (trace_length)
+				trace_push();
+			trace_status = 0;
+		}
+	}
+
+}
+
+/*********************************************************************
+ * debounce_trace_read: get the next captured run
+ *
+ * Parameters:
+ * 		debounce_trace_t *entry
+ * Returns:
+ *		uint8_t	1 if there was a run to read, 0 if not
+ *********************************************************************/
+
+extern uint8_t debounce_trace_read(debounce_trace_t *entry)
+{
+
+	uint8_t tail = trace_tail;
+
+	if (tail == trace_head)
+		return 0;
+
+	*entry = trace_ring[tail];
+	trace_tail = (tail + 1) & TRACE_MASK;	// Release after the copy
+
+	return 1;
+
+}
+
+/*********************************************************************
+ * debounce_trace_status: check on the capture
+ *
+ * Returns:
+ *		uint8_t	DEBOUNCE_TRACE_RUNNING, DEBOUNCE_TRACE_OVERFLOW or 0
+ *********************************************************************/
+
+extern uint8_t debounce_trace_status(void)
+{
+
+	return trace_status;
+
+}
+
+/*********************************************************************
+ * debounce_trace_mask: get the traced pins
+ *
+ * Returns:
+ *		uint8_t	mask
+ *********************************************************************/
+
+extern uint8_t debounce_trace_mask(void)
+{
+
+	return trace_mask;
+
+}
+#endif
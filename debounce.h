@@ -29,14 +29,153 @@
 
 #define OCR_VALUE		80 // Hardcoded for 8 MHz, results in 10ms slices
 
+/************************************************************
+ * Timer
+ *
+ * Timer0 is used by default. Define DEBOUNCE_TIMER1 to use 
+ * Timer1 instead, e.g. when the serial library's USI engine
+ * has Timer0.
+ * Define DEBOUNCE_SERIAL_TICK to use no timer at all: the
+ * serial library's Timer1 interrupt then calls debounce_tick
+ * every 10ms. Build libserial with SERIAL_SYSTEM_TICK.
+ ************************************************************/
+
+//#define DEBOUNCE_TIMER1
+//#define DEBOUNCE_SERIAL_TICK
+#define OCR1_VALUE		77 // Hardcoded for 8 MHz, /1024, results in 10ms slices
+
+/************************************************************
+ * Adaptive debounce
+ *
+ * Define DEBOUNCE_ADAPTIVE to have the library measure how 
+ * long each button bounces and set that button's short press
+ * window to the running estimate plus a margin, within the 
+ * MIN and MAX bounds (in 10ms slices). Buttons start at MAX.
+ * A press still bouncing at the end of its window is dropped,
+ * and the window grows again. MAX can not be more than 
+ * DEBOUNCE_COUNT_SHORT.
+ ************************************************************/
+
+//#define DEBOUNCE_ADAPTIVE
+#define DEBOUNCE_ADAPTIVE_MIN		2
+#define DEBOUNCE_ADAPTIVE_MAX		DEBOUNCE_COUNT_SHORT
+#define DEBOUNCE_ADAPTIVE_MARGIN	2
+
+/************************************************************
+ * Resistor ladder input
+ *
+ * Define DEBOUNCE_ADC_LADDER to read several buttons wired
+ * as a resistor ladder on a single ADC pin. The ADC is
+ * started from the debounce tick and the result is picked
+ * up in the ADC complete interrupt, so the tick never waits
+ * for a conversion.
+ ************************************************************/
+
+//#define DEBOUNCE_ADC_LADDER
+#define DEBOUNCE_LADDER_MAX_BUTTONS	6
+
+/************************************************************
+ * Rotary encoders
+ *
+ * Define DEBOUNCE_ENCODER to decode A/B quadrature encoders.
+ * Decoding is done in the pin change interrupt, so no steps
+ * are lost between 10ms slices. The position counts every
+ * quadrature edge, i.e. 4 counts per full cycle.
+ * Define DEBOUNCE_ENCODER_VELOCITY as well to have the
+ * change in position per 10ms slice available for
+ * acceleration.
+ * The pin change interrupt has a single vector. To share it,
+ * e.g. with serial RX, define DEBOUNCE_SHARED_PCINT and call
+ * debounce_pin_change from your own ISR(PCINT0_vect).
+ ************************************************************/
+
+//#define DEBOUNCE_ENCODER
+//#define DEBOUNCE_ENCODER_VELOCITY
+//#define DEBOUNCE_SHARED_PCINT
+
+typedef void * encoder_t;
+
+/************************************************************
+ * Chords
+ *
+ * Define DEBOUNCE_CHORDS to detect several buttons pressed
+ * together. A chord is reported as a button of its own and
+ * the member presses that made it up are not reported.
+ * Chords work on the first 8 buttons registered.
+ * DEBOUNCE_CHORD_WINDOW is a sensible default for the number 
+ * of 10ms slices all members need to go down in.
+ ************************************************************/
+
+//#define DEBOUNCE_CHORDS
+#define DEBOUNCE_CHORD_WINDOW	10	// 100 ms
+
 typedef void * button_t;
 
+/************************************************************
+ * Diagnostics
+ *
+ * Define DEBOUNCE_DIAGNOSTICS to keep per button statistics.
+ * Counters saturate at 65535. Costs 12 bytes of RAM per
+ * button: 9 of statistics, 1 of state and 2 for bounce
+ * timing (shared with DEBOUNCE_ADAPTIVE, so 10 if that is
+ * on as well).
+ *
+ * There is no interrupt time: no timer runs fast enough to
+ * measure it. Toggle a spare pin around the interrupt and 
+ * use a scope, or count cycles in a simulator.
+ ************************************************************/
+
+//#define DEBOUNCE_DIAGNOSTICS
+
+typedef struct {
+	uint16_t glitches;		// Presses rejected at the short press sample
+	uint16_t short_presses;
+	uint16_t long_presses;
+	uint16_t dropped;		// Presses missed while not acknowledged
+	uint8_t max_bounce;		// Longest bounce seen, in 10ms slices
+} debounce_stats_t;
+
+/************************************************************
+ * Trace capture
+ *
+ * Define DEBOUNCE_TRACE for a logic analyzer mode: while a
+ * capture runs, every 10ms slice samples PINB for the pins
+ * of all registered buttons and encoders. Samples are run
+ * length encoded, so a long stable period takes one entry.
+ * The capture stops by itself when DEBOUNCE_TRACE_SIZE 
+ * entries (power of two) are waiting to be read.
+ ************************************************************/
+
+//#define DEBOUNCE_TRACE
+#define DEBOUNCE_TRACE_SIZE		32
+
+typedef struct {
+	uint8_t pins;			// PINB, masked to the traced pins
+	uint8_t length;			// Number of 10ms slices, 1 - 255
+} debounce_trace_t;
+
 typedef enum {
 	BUTTON_PRESS_NONE,
 	BUTTON_PRESS_SHORT,
 	BUTTON_PRESS_LONG,
 } button_press_t;
 
+/************************************************************
+ * Events
+ *
+ * Define DEBOUNCE_EVENTS to have every press offered to 
+ * DEBOUNCE_EVENT_HANDLER from the interrupt, the moment it
+ * is classified. If the handler returns non 0 it has taken
+ * the press: the press is acknowledged there and then and
+ * button_check never sees it. 0 leaves it for button_check.
+ * The handler runs in the debounce interrupt, so keep it 
+ * short. There is no default: telemetry_button_event sends
+ * the press to the host, see TELEMETRY_FORWARD.
+ ************************************************************/
+
+//#define DEBOUNCE_EVENTS
+//#define DEBOUNCE_EVENT_HANDLER		telemetry_button_event
+
 
 /*********************************************************************
  * debounce_init: setup a button for debouncing
@@ -102,6 +241,302 @@ extern void button_acknowledge(button_t);
 
 extern void button_auto_acknowledge(button_t);
 
+/*********************************************************************
+ * debounce_ticks: get the debounce time base
+ *
+ * Returns:
+ *		uint32_t ticks
+ *			Number of 10ms slices since the first button was
+ *			set up
+ *********************************************************************/
+extern uint32_t debounce_ticks(void);
+
+#ifdef DEBOUNCE_SERIAL_TICK
+/*********************************************************************
+ * debounce_tick: debounce all buttons for one 10ms slice
+ *
+ * Only with DEBOUNCE_SERIAL_TICK. libserial calls this from its 
+ * Timer1 interrupt (SERIAL_SYSTEM_TICK), with interrupts enabled.
+ *********************************************************************/
+extern void debounce_tick(void);
+#endif
+
+#ifdef DEBOUNCE_ADAPTIVE
+/*********************************************************************
+ * button_debounce_window: get the current short press window
+ *
+ * Parameters:
+ * 		button_t button
+ * Returns:
+ *		uint8_t window
+ *			Number of 10ms slices a press needs to last before
+ *			it is sampled for a short press
+ *********************************************************************/
+extern uint8_t button_debounce_window(button_t);
+#endif
+
+#ifdef DEBOUNCE_DIAGNOSTICS
+/*********************************************************************
+ * debounce_diagnostics: get a snapshot of a button's statistics
+ *
+ * Parameters:
+ * 		button_t button
+ *		debounce_stats_t *stats
+ *			Where to put the snapshot
+ *********************************************************************/
+extern void debounce_diagnostics(button_t, debounce_stats_t *);
+
+/*********************************************************************
+ * debounce_diagnostics_reset: clear a button's statistics
+ *
+ * Parameters:
+ * 		button_t button
+ *
+ * This also clears the maximum interrupt time
+ *********************************************************************/
+extern void debounce_diagnostics_reset(button_t);
+
+/*********************************************************************
+ * debounce_diagnostics_print: send a button's statistics out
+ *
+ * Parameters:
+ * 		button_t button
+ *
+ * Sends one line over the serial library, e.g.
+ * "glitches 3 short 10 long 2 dropped 0 bounce 2 isr 1"
+ * Lives in debounce_diag.c, so only link that if you use serial.
+ *********************************************************************/
+extern void debounce_diagnostics_print(button_t);
+#endif
+
+#ifdef DEBOUNCE_ADC_LADDER
+/*********************************************************************
+ * debounce_ladder_init: setup a resistor ladder on an ADC pin
+ *
+ * Parameters
+ *		char * ladder_pin
+ *			ADC capable pin the ladder is connected to, e.g.
+ *			"PB3"
+ *		const uint8_t * thresholds
+ *			Calibrated threshold table, one entry per button,
+ *			in ascending order. An 8 bit ADC reading at or
+ *			below thresholds[i] (and above thresholds[i-1])
+ *			means button i is pressed. Readings above the last
+ *			threshold mean no button is pressed. The table is
+ *			copied, so it need not be kept around
+ *		uint8_t num_buttons
+ *			Number of entries in thresholds, at most
+ *			DEBOUNCE_LADDER_MAX_BUTTONS
+ * Returns
+ *		uint8_t result
+ *			1 on success, 0 on error
+ *
+ * The ladder is expected to pull the pin up to VCC when no button
+ * is pressed. There can only be one ladder.
+ *********************************************************************/
+extern uint8_t debounce_ladder_init(char *, const uint8_t *, uint8_t);
+
+/*********************************************************************
+ * debounce_init_ladder: setup a ladder button for debouncing
+ *
+ * Parameters
+ *		uint8_t button_index
+ *			Index of the button in the threshold table passed
+ *			to debounce_ladder_init
+ * Returns
+ *		button_t button
+ *			Opaque data structure to be used in further
+ *			calls in this library, or NULL on error
+ *
+ * Ladder buttons go through the same short / long / dead time 
+ * handling as normal buttons and are checked with button_check.
+ *********************************************************************/
+extern button_t debounce_init_ladder(uint8_t);
+#endif
+
+#ifdef DEBOUNCE_ENCODER
+/*********************************************************************
+ * debounce_init_encoder: setup a rotary encoder
+ *
+ * Parameters
+ *		char * pin_a
+ *		char * pin_b
+ *			Pins the A and B outputs are connected to, e.g. 
+ *			"PB3". Both are expected to pull to GND.
+ *		char * switch_pin
+ *			Pin the push switch is connected to, or NULL if
+ *			the encoder has no switch
+ * Returns
+ *		encoder_t encoder
+ *			Opaque data structure to be used in further
+ *			calls in this library, or NULL on error
+ *
+ * This uses the pin change interrupt (PCINT0_vect).
+ *********************************************************************/
+extern encoder_t debounce_init_encoder(char *, char *, char *);
+
+/*********************************************************************
+ * encoder_position: get the current encoder position
+ *
+ * Parameters:
+ * 		encoder_t encoder
+ * Returns:
+ *		int16_t position
+ *			Signed position in quadrature counts since init.
+ *			Wraps around on overflow.
+ *********************************************************************/
+extern int16_t encoder_position(encoder_t);
+
+/*********************************************************************
+ * encoder_read_delta: get and clear the movement since last call
+ *
+ * Parameters:
+ * 		encoder_t encoder
+ * Returns:
+ *		int16_t delta
+ *			Signed movement in quadrature counts since the
+ *			previous call
+ *********************************************************************/
+extern int16_t encoder_read_delta(encoder_t);
+
+#ifdef DEBOUNCE_SHARED_PCINT
+/*********************************************************************
+ * debounce_pin_change: decode encoders on a pin change
+ *
+ * Only with DEBOUNCE_SHARED_PCINT, to be called from the
+ * application's ISR(PCINT0_vect)
+ *********************************************************************/
+extern void debounce_pin_change(void);
+#endif
+
+#ifdef DEBOUNCE_ENCODER_VELOCITY
+/*********************************************************************
+ * encoder_velocity: get the encoder speed
+ *
+ * Parameters:
+ * 		encoder_t encoder
+ * Returns:
+ *		int8_t velocity
+ *			Movement in quadrature counts during the last
+ *			10ms slice, clamped to -128..127
+ *********************************************************************/
+extern int8_t encoder_velocity(encoder_t);
+#endif
+
+/*********************************************************************
+ * encoder_button: get the push switch of an encoder
+ *
+ * Parameters:
+ * 		encoder_t encoder
+ * Returns:
+ *		button_t button
+ *			The push switch, to be used with button_check & 
+ *			friends, or NULL if the encoder has none
+ *********************************************************************/
+extern button_t encoder_button(encoder_t);
+#endif
+
+#ifdef DEBOUNCE_CHORDS
+/*********************************************************************
+ * button_mask: get the chord bit of a button
+ *
+ * Parameters:
+ * 		button_t button
+ * Returns:
+ *		uint8_t mask
+ *			Bit identifying the button in chord definitions, 
+ *			0 if the button can not be part of a chord
+ *********************************************************************/
+extern uint8_t button_mask(button_t);
+
+/*********************************************************************
+ * debounce_init_chord: setup a multi-button chord
+ *
+ * Parameters
+ *		uint8_t mask
+ *			The member buttons, OR of button_mask() values.
+ *			Needs at least two members.
+ *		uint8_t window
+ *			Number of 10ms slices between the first and the
+ *			last member being pressed for it to count as a 
+ *			chord, e.g. DEBOUNCE_CHORD_WINDOW
+ * Returns
+ *		button_t button
+ *			Opaque data structure to be used in further
+ *			calls in this library, or NULL on error
+ *
+ * The chord is checked with button_check like any other button. It
+ * is short or long depending on how long all members are held. Once 
+ * a chord is detected, its members do not report anything until they
+ * are released.
+ *
+ * Example:
+ *		service = debounce_init_chord(
+ *			button_mask(button_1) | button_mask(button_2),
+ *			DEBOUNCE_CHORD_WINDOW);
+ *********************************************************************/
+extern button_t debounce_init_chord(uint8_t, uint8_t);
+#endif
+
+#ifdef DEBOUNCE_TRACE
+/*********************************************************************
+ * debounce_trace_start: start a trace capture
+ *
+ * Returns:
+ *		uint32_t tick
+ *			Tick (see debounce_ticks) of the first sample
+ *
+ * Anything left from an earlier capture is discarded.
+ *********************************************************************/
+extern uint32_t debounce_trace_start(void);
+
+/*********************************************************************
+ * debounce_trace_stop: stop a trace capture
+ *
+ * The run in progress is closed, so it can be read.
+ *********************************************************************/
+extern void debounce_trace_stop(void);
+
+/*********************************************************************
+ * debounce_trace_read: get the next captured run
+ *
+ * Parameters:
+ * 		debounce_trace_t *entry
+ *			Filled in with the run
+ * Returns:
+ *		uint8_t	
+ *			1 if there was a run to read, 0 if not
+ *
+ * The run still in progress is only available after it ends.
+ *********************************************************************/
+extern uint8_t debounce_trace_read(debounce_trace_t *);
+
+/*********************************************************************
+ * debounce_trace_status: check on the capture
+ *
+ * Returns:
+ *		uint8_t	
+ *			DEBOUNCE_TRACE_RUNNING while capturing
+ *			DEBOUNCE_TRACE_OVERFLOW if the capture stopped
+ *			because the runs were not read in time. What was
+ *			captured is intact.
+ *			0 otherwise
+ *********************************************************************/
+#define DEBOUNCE_TRACE_RUNNING		1
+#define DEBOUNCE_TRACE_OVERFLOW		2
+
+extern uint8_t debounce_trace_status(void);
+
+/*********************************************************************
+ * debounce_trace_mask: get the traced pins
+ *
+ * Returns:
+ *		uint8_t	mask
+ *			PINB bits that are sampled
+ *********************************************************************/
+extern uint8_t debounce_trace_mask(void);
+#endif
+
 
 
 #endif /* DEBOUNCE_H_ */
@@ -0,0 +1,396 @@
+/*
+ * debounce.hpp
+ *
+ * Header only C++ front end to the debounce library
+ */
+
+
+#ifndef DEBOUNCE_HPP_
+#define DEBOUNCE_HPP_
+
+
+#include <avr/io.h>
+#include <stdint.h>
+#include <util/atomic.h>
+
+extern "C" {
+#include "debounce.h"
+}
+
+/************************************************************
+ * Debouncer<Config, Pins...>
+ *
+ * The short / long press detection of debounce.c, for a set
+ * of PORTB pins fixed at compile time. Pins, thresholds and
+ * timer are template parameters, so the tick is generated
+ * for exactly those buttons: PINB is read once, every button
+ * is a constant bit test on it and a few loads and stores at
+ * fixed addresses. There is no button list, no pointer and
+ * no malloc, and features a Config does not use generate no
+ * code. The C API is unchanged and can still be used for
+ * anything else (ladders, encoders, chords, ...).
+ *
+ * Usage:
+ *		typedef Debouncer<DebounceConfig, PB0, PB2> Buttons;
+ *
+ *		ISR(TIM0_COMPA_vect)
+ *		{
+ *			Buttons::tick();
+ *		}
+ *
+ *		Buttons::init();
+ *		sei();
+ *		...
+ *		if (Buttons::check<PB0>() == BUTTON_PRESS_SHORT)
+ *			Buttons::acknowledge<PB0>();
+ *
+ * The interrupt is written by the application, in one
+ * source file, for the timer the Config selects. Only one of
+ * debounce.c and a Debouncer can own that timer: with
+ * DEBOUNCE_ENGINE_EXTERNAL, init leaves the timers alone and
+ * tick can be called from any 10ms interrupt.
+ *
+ * Pins come last, as a parameter pack has to.
+ *
+ * Size and speed
+ *
+ * debounce_test_cpp.cpp is debounce_test.c on a Debouncer.
+ * "make size-compare" builds both and runs avr-size on them.
+ * Per button and tick, debounce.c follows the list pointer,
+ * calls button_is_pressed through the port pointer, and
+ * works on the button through a pointer register; the
+ * Debouncer does an sbrs on the PINB copy and works on its
+ * slot with direct lds / sts. To compare their interrupt
+ * times, time tick() with a spare pin and a scope, or count
+ * cycles in simulavr.
+ ************************************************************/
+
+typedef enum {
+	DEBOUNCE_ENGINE_TIMER0,		// Timer0 Compare Match A, as debounce.c
+	DEBOUNCE_ENGINE_TIMER1,		// Timer1 Compare Match A, as DEBOUNCE_TIMER1
+	DEBOUNCE_ENGINE_EXTERNAL,	// Application calls tick every 10ms
+} debounce_engine_t;
+
+/************************************************************
+ * DebounceConfig
+ *
+ * The defaults, from debounce.h. Derive from it to change
+ * some, e.g.
+ *
+ *		struct FastConfig : DebounceConfig {
+ *			static const uint8_t count_short = 5;
+ *			static const bool auto_acknowledge = true;
+ *		};
+ *
+ * auto_acknowledge_pins does the same for some pins only, as
+ * button_auto_acknowledge: a PORTB bit mask, e.g. 1 << PB2.
+ ************************************************************/
+
+struct DebounceConfig {
+	static const uint8_t count_short = DEBOUNCE_COUNT_SHORT;
+	static const uint8_t count_mid = DEBOUNCE_COUNT_MID;
+	static const uint8_t count_long = DEBOUNCE_COUNT_LONG;
+	static const uint8_t dead_time_short = DEBOUNCE_DEAD_TIME_SHORT;
+	static const uint8_t dead_time_long = DEBOUNCE_DEAD_TIME_LONG;
+	static const debounce_engine_t engine = DEBOUNCE_ENGINE_TIMER0;
+	static const bool auto_acknowledge = false;	// check acknowledges
+	static const uint8_t auto_acknowledge_pins = 0;	// For these pins only
+	static const bool ticks = false;			// Keep a tick count
+};
+
+/************************************************************
+ * Implementation
+ ************************************************************/
+
+// Per button state. Only press is shared with the main loop
+struct debounce_slot {
+	uint8_t count;				// As current_debounce_count
+	uint8_t dead_time;
+	uint8_t isr_short_press;
+	volatile uint8_t press;		// button_press_t, until acknowledged
+};
+
+// PINB bits of a pin list
+template <uint8_t... Pins>
+struct debounce_mask;
+
+template <uint8_t Pin, uint8_t... Rest>
+struct debounce_mask<Pin, Rest...> {
+	static const uint16_t value = (1 << Pin) | debounce_mask<Rest...>::value;
+	static const uint8_t count = 1 + debounce_mask<Rest...>::count;
+};
+
+template <>
+struct debounce_mask<> {
+	static const uint16_t value = 0;
+	static const uint8_t count = 0;
+};
+
+// Slot index of Pin, 0xff if it is not in the list
+template <uint8_t Pin, uint8_t Index, uint8_t... Pins>
+struct debounce_index;
+
+template <uint8_t Pin, uint8_t Index, uint8_t First, uint8_t... Rest>
+struct debounce_index<Pin, Index, First, Rest...> {
+	static const uint8_t value =
+		Pin == First ? Index : debounce_index<Pin, Index + 1, Rest...>::value;
+};
+
+template <uint8_t Pin, uint8_t Index>
+struct debounce_index<Pin, Index> {
+	static const uint8_t value = 0xff;
+};
+
+// One step per pin, unrolled at compile time
+template <class D, uint8_t Index, uint8_t... Pins>
+struct debounce_each;
+
+template <class D, uint8_t Index, uint8_t Pin, uint8_t... Rest>
+struct debounce_each<D, Index, Pin, Rest...> {
+	static void tick(uint8_t pins)
+	{
+		// Buttons pull to GND
+		D::template step<Index>(!(pins & (1 << Pin)));
+		debounce_each<D, Index + 1, Rest...>::tick(pins);
+	}
+};
+
+template <class D, uint8_t Index>
+struct debounce_each<D, Index> {
+	static void tick(uint8_t) {}
+};
+
+// Tick count, only where the Config asks for it
+template <class D, bool Enabled>
+struct debounce_tick_count {
+	static volatile uint32_t count;
+	static void increment() { count++; }
+};
+
+template <class D, bool Enabled>
+volatile uint32_t debounce_tick_count<D, Enabled>::count = 0;
+
+template <class D>
+struct debounce_tick_count<D, false> {
+	static void increment() {}
+};
+
+/************************************************************
+ * Debouncer
+ ************************************************************/
+
+template <class Config, uint8_t... Pins>
+class Debouncer {
+
+	typedef Debouncer<Config, Pins...> self;
+	typedef debounce_mask<Pins...> mask;
+
+	static_assert(sizeof...(Pins) > 0, "Debouncer needs at least one pin");
+	static_assert(!(mask::value & ~0x3f), "Debouncer pins are PB0 - PB5");
+	static_assert(__builtin_popcount(mask::value) == sizeof...(Pins),
+		"Debouncer pins must be different");
+	static_assert(0 < Config::count_short &&
+		Config::count_short < Config::count_mid &&
+		Config::count_mid < Config::count_long,
+		"Debouncer needs 0 < count_short < count_mid < count_long");
+
+	template <class, uint8_t, uint8_t...>
+	friend struct debounce_each;
+
+	static debounce_slot slots[sizeof...(Pins)];
+
+	/******************************************************************
+	 * report: a press is classified, hold it until acknowledged
+	 ******************************************************************/
+
+	static void report(debounce_slot &slot, button_press_t press, uint8_t dead_time)
+	{
+
+		slot.press = press;
+		slot.dead_time = dead_time;
+
+	}
+
+	/******************************************************************
+	 * step: one tick for one button, as the loop body in debounce.c
+	 ******************************************************************/
+
+	template <uint8_t Index>
+	static void step(uint8_t pressed)
+	{
+
+		debounce_slot &slot = slots[Index];
+		uint8_t count = slot.count;
+
+		// Don't check this button if not acknowledged yet
+		if (slot.press != BUTTON_PRESS_NONE)
+			return;
+
+		// Don't check this button if we are in dead time
+		if (slot.dead_time) {
+			slot.dead_time--;
+			return;
+		}
+
+		if (count == 0) {
+
+			// No previous presses detected
+			if (pressed)
+				count = 1;
+
+		} else if (count == Config::count_short) {
+
+			// Possible short press
+			if (pressed)
+				slot.isr_short_press = 1;
+			count++;
+
+		} else if (count == Config::count_mid) {
+
+			// Halfway between possible short and long press
+			if (slot.isr_short_press && !pressed) {
+				report(slot, BUTTON_PRESS_SHORT, Config::dead_time_short);
+				slot.isr_short_press = 0;
+				count = 0;
+			} else {
+				count++;
+			}
+
+		} else if (count == Config::count_long) {
+
+			// Possible long press
+			if (pressed)
+				report(slot, BUTTON_PRESS_LONG, Config::dead_time_long);
+			else if (slot.isr_short_press)
+				report(slot, BUTTON_PRESS_SHORT, Config::dead_time_short);
+			slot.isr_short_press = 0;
+			count = 0;
+
+		} else {
+
+			count++;
+
+		}
+
+		slot.count = count;
+
+	}
+
+public:
+
+	static const uint8_t button_count = sizeof...(Pins);
+
+	/******************************************************************
+	 * init: set up the pins, and the timer unless engine is external
+	 *
+	 * The timer setup is that of debounce.c: CTC, /1024, 10ms slices
+	 * at 8 MHz. Enable interrupts afterwards.
+	 ******************************************************************/
+
+	static void init()
+	{
+
+		// Inputs with pull up
+		DDRB &= ~mask::value;
+		PORTB |= mask::value;
+
+		if (Config::engine == DEBOUNCE_ENGINE_TIMER0) {
+
+			TCCR0A = (1 << WGM01);
+			OCR0A = OCR_VALUE;
+			TIMSK |= (1 << OCIE0A);
+			TCCR0B = (1 << CS02 | 1 << CS00);
+
+		} else if (Config::engine == DEBOUNCE_ENGINE_TIMER1) {
+
+			TCCR1 = (1 << CTC1);
+			OCR1A = OCR1C = OCR1_VALUE;
+			TIMSK |= (1 << OCIE1A);
+			TCCR1 |= (1 << CS13 | 1 << CS11 | 1 << CS10);
+
+		}
+
+	}
+
+	/******************************************************************
+	 * tick: debounce all buttons, call every 10ms from the interrupt
+	 ******************************************************************/
+
+	static void tick()
+	{
+
+		debounce_tick_count<self, Config::ticks>::increment();
+
+		// All buttons are sampled at the same moment
+		debounce_each<self, 0, Pins...>::tick(PINB);
+
+	}
+
+	/******************************************************************
+	 * check: as button_check, for a pin of this Debouncer
+	 *
+	 * Acknowledges the press if Config::auto_acknowledge is set, or 
+	 * Pin's bit in Config::auto_acknowledge_pins
+	 ******************************************************************/
+
+	template <uint8_t Pin>
+	static button_press_t check()
+	{
+
+		static_assert(debounce_index<Pin, 0, Pins...>::value != 0xff,
+			"Pin is not handled by this Debouncer");
+
+		debounce_slot &slot = slots[debounce_index<Pin, 0, Pins...>::value];
+		button_press_t result = (button_press_t) slot.press;
+
+		// The interrupt leaves press alone until it is cleared
+		if ((Config::auto_acknowledge || 
+				(Config::auto_acknowledge_pins & (1 << Pin))) &&
+				result != BUTTON_PRESS_NONE)
+			slot.press = BUTTON_PRESS_NONE;
+
+		return result;
+
+	}
+
+	/******************************************************************
+	 * acknowledge: as button_acknowledge
+	 ******************************************************************/
+
+	template <uint8_t Pin>
+	static void acknowledge()
+	{
+
+		static_assert(debounce_index<Pin, 0, Pins...>::value != 0xff,
+			"Pin is not handled by this Debouncer");
+
+		slots[debounce_index<Pin, 0, Pins...>::value].press = BUTTON_PRESS_NONE;
+
+	}
+
+	/******************************************************************
+	 * ticks: as debounce_ticks, needs Config::ticks
+	 ******************************************************************/
+
+	static uint32_t ticks()
+	{
+
+		uint32_t ticks;
+
+		static_assert(Config::ticks, "Set ticks in the Config to count ticks");
+
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			ticks = debounce_tick_count<self, Config::ticks>::count;
+		}
+
+		return ticks;
+
+	}
+
+};
+
+template <class Config, uint8_t... Pins>
+debounce_slot Debouncer<Config, Pins...>::slots[sizeof...(Pins)];
+
+
+#endif /* DEBOUNCE_HPP_ */
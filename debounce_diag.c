@@ -0,0 +1,61 @@
+/*
+ * debounce_diag.c
+ *
+ * Serial output of the debounce diagnostics. Kept apart from
+ * debounce.c so the debounce library does not need libserial.
+ */ 
+
+
+#include <avr/io.h>
+#include <stdint.h>
+
+#include "debounce.h"
+#include "serial.h"
+
+#ifdef DEBOUNCE_DIAGNOSTICS
+
+/*********************************************************************
+ * Private functions
+ *********************************************************************/
+
+/******************************************************************
+ * send_value: send a label and a decimal value
+ ******************************************************************/
+
+static void send_value(char *label, uint16_t value)
+{
+
+	serial_send_data(label);
+	serial_put_char(' ');
+	serial_put_u16(value);
+
+}
+
+/*********************************************************************
+ * Public functions
+ *********************************************************************/
+
+/*********************************************************************
+ * debounce_diagnostics_print: send a button's statistics out
+ *
+ * Parameters:
+ * 		button_t button
+ *********************************************************************/
+
+extern void debounce_diagnostics_print(button_t button)
+{
+
+	debounce_stats_t stats;
+
+	debounce_diagnostics(button, &stats);
+
+	send_value("glitches", stats.glitches);
+	send_value(" short", stats.short_presses);
+	send_value(" long", stats.long_presses);
+	send_value(" dropped", stats.dropped);
+	send_value(" bounce", stats.max_bounce);
+	serial_send_data("\r\n");
+
+}
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <stdlib.h>
 #include <string.h>
 #include <util/delay.h>
@@ -25,34 +26,34 @@ int main(void)
 	
 	sei();
 
-	serial_send_data("Off we go\r\n");
+	serial_send_P(PSTR("Off we go\r\n"));
 	
     while (1) 
     {
 
 		if(button_check(button_1) == BUTTON_PRESS_SHORT) {
-			serial_send_data("Button 1 short");
+			serial_send_P(PSTR("Button 1 short"));
 			button_acknowledge(button_1);
 		}
 
 		if(button_check(button_1) == BUTTON_PRESS_LONG) {
-			serial_send_data("Button 1 long");
+			serial_send_P(PSTR("Button 1 long"));
 			button_acknowledge(button_1);
 		}
 		
 		switch (button_check(button_2)) {
 			case BUTTON_PRESS_SHORT:	
-				serial_send_data("Button 2 short");
+				serial_send_P(PSTR("Button 2 short"));
 				break;
 
 			case BUTTON_PRESS_LONG:
-				serial_send_data("Button 2 long");
+				serial_send_P(PSTR("Button 2 long"));
 				break;
 		}
 		
 		_delay_ms(200);
 
-		serial_send_data("Canary\r\n");
+		serial_send_P(PSTR("Canary\r\n"));
 
  }
 }
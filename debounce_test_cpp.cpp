@@ -0,0 +1,74 @@
+/*
+ * debounce_test_cpp.cpp
+ *
+ * debounce_test.c on the C++ front end, for size and speed
+ * comparisons: make size-compare
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+#include "debounce.hpp"
+
+extern "C" {
+#include "serial.h"
+}
+
+// Button 2 is auto acknowledged, as in debounce_test.c
+struct TestConfig : DebounceConfig {
+	static const uint8_t auto_acknowledge_pins = 1 << PB2;
+};
+
+typedef Debouncer<TestConfig, PB0, PB2> Buttons;
+
+ISR(TIM0_COMPA_vect)
+{
+
+	Buttons::tick();
+
+}
+
+int main(void)
+{
+
+	serial_initialise();
+
+	Buttons::init();
+
+	sei();
+
+	serial_send_P(PSTR("Off we go\r\n"));
+
+	while (1)
+	{
+
+		if (Buttons::check<PB0>() == BUTTON_PRESS_SHORT) {
+			serial_send_P(PSTR("Button 1 short"));
+			Buttons::acknowledge<PB0>();
+		}
+
+		if (Buttons::check<PB0>() == BUTTON_PRESS_LONG) {
+			serial_send_P(PSTR("Button 1 long"));
+			Buttons::acknowledge<PB0>();
+		}
+
+		switch (Buttons::check<PB2>()) {
+			case BUTTON_PRESS_SHORT:
+				serial_send_P(PSTR("Button 2 short"));
+				break;
+
+			case BUTTON_PRESS_LONG:
+				serial_send_P(PSTR("Button 2 long"));
+				break;
+
+			default:
+				break;
+		}
+
+		_delay_ms(200);
+
+		serial_send_P(PSTR("Canary\r\n"));
+
+	}
+}
@@ -6,28 +6,311 @@
 
 #include <avr/io.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "serial.h"
+#ifdef SERIAL_STDIO
+#include <stdio.h>
+#endif
 #include <avr/interrupt.h>
-
-#define NUM_SPEED		   6 
-#define PRESCALER_DIVISOR   8
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include <util/delay.h>
 
 // Status codes
 #define SERIAL_IDLE						0b00000000
-#define SERIAL_SENT_START_BIT			0b00000001
-#define SERIAL_SENDING_DATA				0b00000010
-#define SERIAL_TX_BUFFER_LOCKED			0b00000100
-#define SERIAL_RECEIVED_START_BIT		0b00001000
-#define SERIAL_RECEIVING_DATA			0b00010000
-#define SERIAL_RECEIVE_OVERFLOW			0b00100000
+#define SERIAL_NOT_INITIALISED		0b10000000
 
-#define SERIAL_TRANSMITTING				0b00000111
+// Buffers are rings indexed by uint8_t, so sizes must be a power of two
+// of at most 256. One byte is always kept free to tell full from empty.
+#if (TX_BUFFER_SIZE & (TX_BUFFER_SIZE - 1)) || TX_BUFFER_SIZE > 256
+#error TX_BUFFER_SIZE must be a power of two, at most 256
+#endif
+#if (RX_BUFFER_SIZE & (RX_BUFFER_SIZE - 1)) || RX_BUFFER_SIZE > 256
+#error RX_BUFFER_SIZE must be a power of two, at most 256
+#endif
 
-#define SERIAL_NOT_INITIALISED		0b10000000
+#if (TX_DESCRIPTOR_COUNT & (TX_DESCRIPTOR_COUNT - 1)) || TX_DESCRIPTOR_COUNT > 256
+#error TX_DESCRIPTOR_COUNT must be a power of two, at most 256
+#endif
+
+#ifdef SERIAL_TX_USI
+#ifndef TX_ONLY
+#error SERIAL_TX_USI only supports TX_ONLY
+#endif
+#if SERIAL_TX_CHANNELS > 1
+#error SERIAL_TX_USI only supports one TX channel
+#endif
+#endif
+
+#if SERIAL_TX_CHANNELS < 1 || SERIAL_TX_CHANNELS > 4
+#error SERIAL_TX_CHANNELS must be 1 - 4
+#endif
+
+#if defined(SERIAL_AUTOBAUD) && defined(TX_ONLY)
+#error SERIAL_AUTOBAUD needs RX, undefine TX_ONLY
+#endif
+
+#ifdef SERIAL_SYSTEM_TICK
+#ifdef SERIAL_TX_USI
+#error SERIAL_SYSTEM_TICK needs the Timer1 engine, not SERIAL_TX_USI
+#endif
+#ifdef SERIAL_AUTOBAUD
+#error SERIAL_SYSTEM_TICK can not be combined with SERIAL_AUTOBAUD
+#endif
+#endif
+
+// Any rate can be had by defining SERIAL_BAUD directly instead
+#ifndef SERIAL_BAUD
+#if SERIAL_SPEED == SERIAL_SPEED_2400
+#define SERIAL_BAUD		2400UL
+#elif SERIAL_SPEED == SERIAL_SPEED_9600
+#define SERIAL_BAUD		9600UL
+#elif SERIAL_SPEED == SERIAL_SPEED_19200
+#define SERIAL_BAUD		19200UL
+#elif SERIAL_SPEED == SERIAL_SPEED_38400
+#define SERIAL_BAUD		38400UL
+#elif SERIAL_SPEED == SERIAL_SPEED_57600
+#define SERIAL_BAUD		57600UL
+#elif SERIAL_SPEED == SERIAL_SPEED_115200
+#define SERIAL_BAUD		115200UL
+#elif SERIAL_SPEED == SERIAL_SPEED_230400
+#define SERIAL_BAUD		230400UL
+#elif SERIAL_SPEED == SERIAL_SPEED_250000
+#define SERIAL_BAUD		250000UL
+#else
+#error Unknown SERIAL_SPEED
+#endif
+#endif
+
+// Timer counts per bit for a given timer clock, prescaler and rate, 
+// rounded to nearest
+#define BAUD_COUNTS(clock, div, baud)	\
+	(((clock) + (div) * (baud) / 2) / ((div) * (baud)))
+#define BIT_COUNTS(clock, div)	BAUD_COUNTS(clock, div, SERIAL_BAUD)
+
+// Nonzero if div * counts timer clocks per bit is within 
+// SERIAL_MAX_BAUD_ERROR percent of the requested rate
+#define BAUD_OK(clock, div, counts)	\
+	((clock) * 100 <= (div) * (counts) * SERIAL_BAUD * (100 + SERIAL_MAX_BAUD_ERROR) && \
+	 (clock) * 100 >= (div) * (counts) * SERIAL_BAUD * (100 - SERIAL_MAX_BAUD_ERROR))
+
+#ifdef SERIAL_TX_USI
+// Timer0 runs at the bit rate and clocks the USI. Pick the smallest
+// prescaler that gets the compare value into 8 bits
+#if BIT_COUNTS(F_CPU, 1) <= 256
+#define USI_PRESCALER_BITS	(1 << CS00)
+#define USI_DIVISOR			1UL
+#elif BIT_COUNTS(F_CPU, 8) <= 256
+#define USI_PRESCALER_BITS	(1 << CS01)
+#define USI_DIVISOR			8UL
+#elif BIT_COUNTS(F_CPU, 64) <= 256
+#define USI_PRESCALER_BITS	(1 << CS01 | 1 << CS00)
+#define USI_DIVISOR			64UL
+#elif BIT_COUNTS(F_CPU, 256) <= 256
+#define USI_PRESCALER_BITS	(1 << CS02)
+#define USI_DIVISOR			256UL
+#elif BIT_COUNTS(F_CPU, 1024) <= 256
+#define USI_PRESCALER_BITS	(1 << CS02 | 1 << CS00)
+#define USI_DIVISOR			1024UL
+#else
+#error SERIAL_SPEED too slow for this F_CPU
+#endif
+#define USI_TIMER_COUNTS	BIT_COUNTS(F_CPU, USI_DIVISOR)
+
+#if !BAUD_OK(F_CPU, USI_DIVISOR, USI_TIMER_COUNTS)
+#error SERIAL_SPEED cannot be generated within SERIAL_MAX_BAUD_ERROR at this F_CPU
+#endif
+
+#define USI_COUNTER_FIRST_HALF	(16 - 7)	// Start bit and data bits 0 - 5
+#define USI_COUNTER_SECOND_HALF	(16 - 3)	// Data bits 6, 7 and stop bit
+#else
+// Timer1 runs at exactly the bit rate, from the system clock or the 
+// 64 MHz PLL. Pick the smallest of its 15 prescalers that gets the 
+// compare value into 8 bits. The CS1x bits for prescaler 2^n are n + 1.
+#ifdef SERIAL_TIMER1_PLL
+#define TIMER1_CLOCK		64000000UL
+#else
+#define TIMER1_CLOCK		F_CPU
+#endif
+
+#define TIMER1_COUNTS(div)	BIT_COUNTS(TIMER1_CLOCK, div)
+#if TIMER1_COUNTS(1) <= 256
+#define TIMER1_PRESCALER_BITS	1
+#define TIMER1_DIVISOR			1UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(1)
+#elif TIMER1_COUNTS(2) <= 256
+#define TIMER1_PRESCALER_BITS	2
+#define TIMER1_DIVISOR			2UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(2)
+#elif TIMER1_COUNTS(4) <= 256
+#define TIMER1_PRESCALER_BITS	3
+#define TIMER1_DIVISOR			4UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(4)
+#elif TIMER1_COUNTS(8) <= 256
+#define TIMER1_PRESCALER_BITS	4
+#define TIMER1_DIVISOR			8UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(8)
+#elif TIMER1_COUNTS(16) <= 256
+#define TIMER1_PRESCALER_BITS	5
+#define TIMER1_DIVISOR			16UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(16)
+#elif TIMER1_COUNTS(32) <= 256
+#define TIMER1_PRESCALER_BITS	6
+#define TIMER1_DIVISOR			32UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(32)
+#elif TIMER1_COUNTS(64) <= 256
+#define TIMER1_PRESCALER_BITS	7
+#define TIMER1_DIVISOR			64UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(64)
+#elif TIMER1_COUNTS(128) <= 256
+#define TIMER1_PRESCALER_BITS	8
+#define TIMER1_DIVISOR			128UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(128)
+#elif TIMER1_COUNTS(256) <= 256
+#define TIMER1_PRESCALER_BITS	9
+#define TIMER1_DIVISOR			256UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(256)
+#elif TIMER1_COUNTS(512) <= 256
+#define TIMER1_PRESCALER_BITS	10
+#define TIMER1_DIVISOR			512UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(512)
+#elif TIMER1_COUNTS(1024) <= 256
+#define TIMER1_PRESCALER_BITS	11
+#define TIMER1_DIVISOR			1024UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(1024)
+#elif TIMER1_COUNTS(2048) <= 256
+#define TIMER1_PRESCALER_BITS	12
+#define TIMER1_DIVISOR			2048UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(2048)
+#elif TIMER1_COUNTS(4096) <= 256
+#define TIMER1_PRESCALER_BITS	13
+#define TIMER1_DIVISOR			4096UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(4096)
+#elif TIMER1_COUNTS(8192) <= 256
+#define TIMER1_PRESCALER_BITS	14
+#define TIMER1_DIVISOR			8192UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(8192)
+#elif TIMER1_COUNTS(16384) <= 256
+#define TIMER1_PRESCALER_BITS	15
+#define TIMER1_DIVISOR			16384UL
+#define TIMER1_COUNTS_PER_BIT	TIMER1_COUNTS(16384)
+#else
+#error SERIAL_SPEED too slow for this F_CPU
+#endif
+
+#if !BAUD_OK(TIMER1_CLOCK, TIMER1_DIVISOR, TIMER1_COUNTS_PER_BIT)
+#error SERIAL_SPEED cannot be generated within SERIAL_MAX_BAUD_ERROR at this F_CPU
+#endif
+
+// Every bit costs a Timer1 interrupt, two with RX. Below this many CPU
+// cycles per bit they will not keep up
+#ifdef TX_ONLY
+#define MIN_CYCLES_PER_BIT	80
+#else
+#define MIN_CYCLES_PER_BIT	200
+#endif
+#if F_CPU / SERIAL_BAUD < MIN_CYCLES_PER_BIT
+#warning SERIAL_SPEED is too fast for the Timer1 engine at this F_CPU
+#endif
+
+#define TIMER1_CS_MASK		(1 << CS13 | 1 << CS12 | 1 << CS11 | 1 << CS10)
+#define TX_FRAME_STOP_BIT	(1 << 9)
+
+#ifdef SERIAL_SYSTEM_TICK
+// Bit periods per 10ms tick, rounded to nearest
+#define SYSTEM_TICK_BITS	((SERIAL_BAUD + 50) / 100)
+#if SYSTEM_TICK_BITS > 65535
+#error SERIAL_SPEED too fast for SERIAL_SYSTEM_TICK
+#endif
+#endif
+
+// All TX pins, for the combined port write
+#if SERIAL_TX_CHANNELS == 1
+#define TX_PINS_MASK	(1 << TX_PIN)
+#elif SERIAL_TX_CHANNELS == 2
+#define TX_PINS_MASK	(1 << TX_PIN | 1 << TX_PIN_1)
+#elif SERIAL_TX_CHANNELS == 3
+#define TX_PINS_MASK	(1 << TX_PIN | 1 << TX_PIN_1 | 1 << TX_PIN_2)
+#else
+#define TX_PINS_MASK	(1 << TX_PIN | 1 << TX_PIN_1 | 1 << TX_PIN_2 | 1 << TX_PIN_3)
+#endif
+
+#ifndef TX_ONLY
+// RX samples on Compare Match B, half a bit period after the start bit
+// edge, minus the time it takes to get from the edge to reading TCNT1
+// and the spread of the three samples
+#define RX_SAMPLE_SPACING		8		// CPU cycles between the 3 samples
+#define RX_LATENCY_COUNTS		\
+	((24 + RX_SAMPLE_SPACING) * (TIMER1_CLOCK / F_CPU) / TIMER1_DIVISOR)
+#if TIMER1_COUNTS_PER_BIT / 2 > RX_LATENCY_COUNTS
+#define RX_HALF_BIT_COUNTS		(TIMER1_COUNTS_PER_BIT / 2 - RX_LATENCY_COUNTS)
+#else
+#define RX_HALF_BIT_COUNTS		1
+#endif
+
+#ifdef SERIAL_AUTOBAUD
+// The same sums at run time, for any of the rates autobaud can pick: 
+// prescaler 2^AUTOBAUD_SHIFT(baud), compare value and half bit.
+#define AUTOBAUD_FITS(baud, n)	\
+	(BAUD_COUNTS(TIMER1_CLOCK, 1UL << (n), baud) <= 256)
+#define AUTOBAUD_SHIFT(baud)	\
+	(AUTOBAUD_FITS(baud, 0) ? 0 : AUTOBAUD_FITS(baud, 1) ? 1 : \
+	 AUTOBAUD_FITS(baud, 2) ? 2 : AUTOBAUD_FITS(baud, 3) ? 3 : \
+	 AUTOBAUD_FITS(baud, 4) ? 4 : AUTOBAUD_FITS(baud, 5) ? 5 : \
+	 AUTOBAUD_FITS(baud, 6) ? 6 : AUTOBAUD_FITS(baud, 7) ? 7 : \
+	 AUTOBAUD_FITS(baud, 8) ? 8 : AUTOBAUD_FITS(baud, 9) ? 9 : \
+	 AUTOBAUD_FITS(baud, 10) ? 10 : AUTOBAUD_FITS(baud, 11) ? 11 : \
+	 AUTOBAUD_FITS(baud, 12) ? 12 : AUTOBAUD_FITS(baud, 13) ? 13 : 14)
+#define AUTOBAUD_COUNTS(baud)	\
+	BAUD_COUNTS(TIMER1_CLOCK, 1UL << AUTOBAUD_SHIFT(baud), baud)
+#define AUTOBAUD_LATENCY(baud)	\
+	(((24 + RX_SAMPLE_SPACING) * (TIMER1_CLOCK / F_CPU)) >> AUTOBAUD_SHIFT(baud))
+#define AUTOBAUD_HALF_BIT(baud)	\
+	(AUTOBAUD_COUNTS(baud) / 2 > AUTOBAUD_LATENCY(baud) ? \
+	 AUTOBAUD_COUNTS(baud) / 2 - AUTOBAUD_LATENCY(baud) : 1)
+
+// While measuring, Timer1 runs free (no CTC) with the smallest 
+// prescaler that brings it down to 2 MHz or less. Eight bits at 2400
+// baud then still fit in 16 bits, and 115200 baud is over 100 counts.
+#if TIMER1_CLOCK / 1 <= 2000000UL
+#define AUTOBAUD_PRESCALER_BITS	1
+#define AUTOBAUD_DIVISOR		1UL
+#elif TIMER1_CLOCK / 2 <= 2000000UL
+#define AUTOBAUD_PRESCALER_BITS	2
+#define AUTOBAUD_DIVISOR		2UL
+#elif TIMER1_CLOCK / 4 <= 2000000UL
+#define AUTOBAUD_PRESCALER_BITS	3
+#define AUTOBAUD_DIVISOR		4UL
+#elif TIMER1_CLOCK / 8 <= 2000000UL
+#define AUTOBAUD_PRESCALER_BITS	4
+#define AUTOBAUD_DIVISOR		8UL
+#elif TIMER1_CLOCK / 16 <= 2000000UL
+#define AUTOBAUD_PRESCALER_BITS	5
+#define AUTOBAUD_DIVISOR		16UL
+#else
+#define AUTOBAUD_PRESCALER_BITS	6
+#define AUTOBAUD_DIVISOR		32UL
+#endif
+
+// Measured length of the eight bit periods of a sync byte
+#define AUTOBAUD_SYNC_COUNTS(baud)	\
+	BAUD_COUNTS(TIMER1_CLOCK, AUTOBAUD_DIVISOR, baud) * 8
+
+#define AUTOBAUD_RATE(baud)	\
+	{baud, AUTOBAUD_SYNC_COUNTS(baud), AUTOBAUD_SHIFT(baud) + 1, \
+	 AUTOBAUD_COUNTS(baud), AUTOBAUD_HALF_BIT(baud)}
+
+#define AUTOBAUD_SYNC_EDGES		5		// Falling edges in 0x55
+#define AUTOBAUD_LOCKED			0xff	// autobaud_edges when done
+#endif
+#endif
+#endif
 
+#define TX_BUFFER_MASK		(TX_BUFFER_SIZE - 1)
+#define TX_DESCRIPTOR_MASK	(TX_DESCRIPTOR_COUNT - 1)
+#define RX_BUFFER_MASK		(RX_BUFFER_SIZE - 1)
 
 
 /************************************************************************
@@ -36,35 +319,178 @@
 
 static uint8_t connection_state = SERIAL_NOT_INITIALISED;
 
-// Timer OCR values for clock & sample offset tresholds for RX (which are
-// half the timer_ocr_values, plus some allowance for latency)
-// Values below are for 8 MHz.
-static uint8_t timer_ocr_values[NUM_SPEED] = {208, 52, 25, 12, 8, 3};
+// Each buffer has exactly one producer and one consumer: for TX the main
+// loop writes and the Timer1 interrupt reads, for RX the other way round.
+// The producer only ever moves head, the consumer only ever moves tail,
+// and both are single bytes, so neither side needs a lock or cli(). The
+// producer stores the data before it publishes the new head, the consumer
+// reads the data before it publishes the new tail.
+struct buffer {
+	volatile uint8_t *data;	// Volatile so data stores stay before head stores
+	uint8_t head;		// Head: points to where next byte will be written
+	uint8_t tail;		// Tail: points to next byte to be read
+};
+
+static volatile struct buffer rx_buffer = {NULL, 0, 0};
+
+// TX descriptors reference data that is sent without going through
+// the TX buffer: a string in flash, or a producer callback. Position is 
+// the buffer head at the time the descriptor was queued: once the 
+// buffer tail gets there, everything queued before it has gone out
+// and it is the descriptor's turn. Same single producer, single consumer
+// discipline as the buffers.
+struct tx_descriptor {
+	uint8_t position;
+	serial_producer_t producer;	// NULL for a flash string
+	const void *data;		// Flash string, or producer context
+};
 
-#ifndef TX_ONLY
-static uint8_t sample_offset_treshold[NUM_SPEED] = {120, 30, 14, 7, 5, 1};
+// Everything one TX pin needs. The main loop fills buffer and 
+// descriptors, the rest belongs to the transmit interrupt.
+struct tx_channel {
+	volatile struct buffer buffer;
+	volatile struct tx_descriptor descriptors[TX_DESCRIPTOR_COUNT];
+	volatile uint8_t descriptor_head;
+	volatile uint8_t descriptor_tail;
+	PGM_P flash;			// Descriptor being sent
+	serial_producer_t producer;
+	void *context;
+	uint8_t byte;			// Byte being sent
+#ifndef SERIAL_TX_USI
+	// Frame still to be sent, LSB first: start bit, 8 data bits, stop
+	// bit. 0 when the stop bit has gone out.
+	uint16_t frame;
+	uint8_t mask;			// TX pin bit in TX_PORT
 #endif
+};
 
-struct buffer {
-	uint8_t lock;
-	uint8_t *data;
-	uint16_t top;		// Top: points to where next byte will be written
-	uint8_t dirty;
+static struct tx_channel tx_channels[SERIAL_TX_CHANNELS];
+
+// The channel the TX functions work on. With a single channel this is a
+// constant, so the compiler can address it directly.
+#if SERIAL_TX_CHANNELS > 1
+static struct tx_channel *tx_current = tx_channels;
+#else
+#define tx_current	tx_channels
+#endif
+
+#ifndef SERIAL_TX_USI
+static const uint8_t tx_channel_pins[SERIAL_TX_CHANNELS] = {
+	TX_PIN,
+#if SERIAL_TX_CHANNELS > 1
+	TX_PIN_1,
+#endif
+#if SERIAL_TX_CHANNELS > 2
+	TX_PIN_2,
+#endif
+#if SERIAL_TX_CHANNELS > 3
+	TX_PIN_3,
+#endif
 };
+#endif
+
+// Set by the interrupt when it runs out of data to send, cleared by 
+// start_tx when there is some again
+static volatile uint8_t tx_idle = 1;
 
-static volatile struct buffer rx_buffer = {0, NULL, 0, 0};
-static volatile struct buffer tx_buffer = {0, NULL, 0, 0};
+#ifndef SERIAL_TX_USI
+// Set while the transmit interrupt loads frames with interrupts enabled.
+// A Compare Match A that comes in meanwhile only sends its bits.
+static volatile uint8_t tx_refilling = 0;
+#endif
 
-static volatile uint8_t rx_bit_counter = 0;
-static volatile uint8_t tx_bit_counter = 0;
-static volatile uint8_t tx_byte = 0;
-static volatile uint8_t tx_phase = 0;
+#ifdef SERIAL_TX_USI
+static uint8_t usi_second_half = 0;
+static uint8_t usi_reversed_byte = 0;
+#endif
 
 #ifndef TX_ONLY
-static volatile uint8_t rx_byte = 0;
-static volatile uint8_t rx_phase = 0;
-static volatile uint8_t rx_sample_countdown = 0;
-static volatile uint8_t rx_start_bit_timecount = 0;
+// Set while a frame is being received. Timer1 keeps running as long as
+// either direction needs it
+static volatile uint8_t rx_active = 0;
+static volatile uint8_t rx_enabled = 0;
+
+// Frame being received, Timer1 Compare Match B interrupt only. Bit 0 is
+// the start bit, 1 - 8 are data, 9 is the stop bit
+static uint8_t rx_bit_counter = 0;
+static uint8_t rx_byte = 0;
+
+// Error accounting
+static volatile uint16_t rx_overflows = 0;		// Bytes dropped, buffer full
+static volatile uint16_t rx_framing_errors = 0;	// No stop bit
+#endif
+
+#ifdef SERIAL_EVENTS
+// Event source of channel 0, see serial_set_event_source. Set while
+// the interrupts are off, read by fetch_tx_byte only
+static serial_producer_t event_source = NULL;
+static void *event_context = NULL;
+static uint8_t event_active = 0;		// An event frame is going out
+#endif
+
+#ifdef SERIAL_SYSTEM_TICK
+// Bit periods to the next tick, Timer1 Compare Match A interrupt only
+static uint16_t system_tick_counter = SYSTEM_TICK_BITS;
+
+// Ticks for the handler, counted up where the bits go out and down
+// once interrupts are enabled
+static volatile uint8_t system_ticks_due = 0;
+
+extern void SERIAL_TICK_HANDLER(void);
+#endif
+
+#ifdef SERIAL_AUTOBAUD
+// A rate autobaud can pick, with everything Timer1 needs for it
+struct autobaud_rate {
+	uint32_t baud;
+	uint16_t sync_counts;		// Sync byte length while measuring
+	uint8_t prescaler_bits;
+	uint8_t counts;				// Timer1 counts per bit
+	uint8_t half_bit;			// As RX_HALF_BIT_COUNTS
+};
+
+// Only the rates the Timer1 engine keeps up with at this F_CPU
+static const struct autobaud_rate autobaud_rates[] PROGMEM = {
+	AUTOBAUD_RATE(2400UL),
+#if F_CPU / 9600 >= MIN_CYCLES_PER_BIT
+	AUTOBAUD_RATE(9600UL),
+#endif
+#if F_CPU / 19200 >= MIN_CYCLES_PER_BIT
+	AUTOBAUD_RATE(19200UL),
+#endif
+#if F_CPU / 38400 >= MIN_CYCLES_PER_BIT
+	AUTOBAUD_RATE(38400UL),
+#endif
+#if F_CPU / 57600 >= MIN_CYCLES_PER_BIT
+	AUTOBAUD_RATE(57600UL),
+#endif
+#if F_CPU / 115200 >= MIN_CYCLES_PER_BIT
+	AUTOBAUD_RATE(115200UL),
+#endif
+};
+
+// Longest gap between two falling edges of a sync byte: two bit 
+// periods at the slowest rate, plus a margin
+#define AUTOBAUD_MAX_GAP	(AUTOBAUD_SYNC_COUNTS(2400UL) / 4 * 5 / 4)
+
+// Timer1 settings in use. SERIAL_SPEED until a rate is detected
+static uint8_t timer1_prescaler_bits = TIMER1_PRESCALER_BITS;
+static uint8_t rx_half_bit_counts = RX_HALF_BIT_COUNTS;
+static volatile uint32_t baud_rate = SERIAL_BAUD;
+
+// Measurement, pin change and Timer1 overflow interrupts only. Times 
+// are 16 bits: Timer1 overflows above TCNT1
+static volatile uint8_t autobaud_edges = AUTOBAUD_LOCKED;	// Falling edges so far
+static volatile uint8_t autobaud_overflows = 0;
+static uint16_t autobaud_first = 0;		// Start bit edge
+static uint16_t autobaud_last = 0;		// Latest edge
+static uint16_t autobaud_gap = 0;		// Between the first two edges
+
+#define TIMER1_CS_BITS		timer1_prescaler_bits
+#define RX_HALF_BIT			rx_half_bit_counts
+#else
+#define TIMER1_CS_BITS		TIMER1_PRESCALER_BITS
+#define RX_HALF_BIT			RX_HALF_BIT_COUNTS
 #endif
 
 
@@ -107,19 +533,24 @@ static return_code_t setup_io(
 	if (pin > 5)
 		return SERIAL_ERROR;
 
-	switch (dir) {
+	// pin is not a constant, so these are read-modify-writes
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+
+		switch (dir) {
 		
-		case SERIAL_DIR_TX:
+			case SERIAL_DIR_TX:
 
-			DDRB |= (1 << pin);
-			PORTB |= (1 << pin);  // Set high (idle)
-			break;
+				DDRB |= (1 << pin);
+				PORTB |= (1 << pin);  // Set high (idle)
+				break;
 
-		case SERIAL_DIR_RX:
+			case SERIAL_DIR_RX:
 		
-			DDRB &= ~(1 << pin);
-			PORTB &= ~(1 << pin);  // No pullup
-			break;
+				DDRB &= ~(1 << pin);
+				PORTB &= ~(1 << pin);  // No pullup
+				break;
+
+		}
 
 	}
 
@@ -128,73 +559,109 @@ static return_code_t setup_io(
 }
 
 /************************************************************************
- * move_connection_state: change connection state to a new state
+ * buffer_empty: check whether there is anything in a buffer
  *
  * Parameters:
- *		uint8_t	src_state	State to move from
- *		uint8_t	dst_state	State to move to
- * 
- * Actual state values are defined in serial.h
+ *		struct buffer *buffer	The subject buffer
  ************************************************************************/
 
-static void move_connection_state(uint8_t src_state, uint8_t dst_state)
+static uint8_t buffer_empty(volatile struct buffer *buffer)
 {
 
-	connection_state &= ~src_state;
-	connection_state |= dst_state;
+	return buffer->head == buffer->tail;
 
 }
 
 /************************************************************************
- * send_data_bit: set the tx pin to a new data bit
+ * fetch_tx_byte: get a channel's next byte to send into channel->byte
  *
  * Parameters:
- *		uint8_t	bit	The data bit to send
+ *		struct tx_channel *channel	The channel
+ *
+ * Returns:
+ *		1 if there is a byte to send
+ *		0 if there is nothing to send
+ *
+ * Takes bytes from the producer or flash string being sent, if any, 
+ * otherwise from the channel's buffer. A descriptor whose position the
+ * buffer tail has reached goes first. Only to be called from the Timer1 interrupt.
+ * With SERIAL_EVENTS, channel 0 asks the event source once all of that
+ * is empty, and then takes its bytes up to the end of the frame.
  ************************************************************************/
 
-static void send_data_bit(uint8_t bit)
+static uint8_t fetch_tx_byte(struct tx_channel *channel)
 {
 
-		if (tx_byte & (1 << bit)) {
-				TX_PORT |= (1 << TX_PIN);
-		} else {
-				TX_PORT &= ~(1 << TX_PIN);
-		}
+	int16_t data;
+	uint8_t descriptor_tail;
 
-}
+#ifdef SERIAL_EVENTS
+	// An event frame goes out in one piece
+	if (channel == tx_channels && event_active) {
+		data = event_source(event_context);
+		if (data >= 0) {
+			channel->byte = data;
+			return 1;
+		}
+		event_active = 0;
+	}
+#endif
 
-/************************************************************************
- * shift_buffer_down: shift out lowest byte of a buffer, with locking
- *
- * Parameters:
- *		struct buffer *buffer	The subject buffer
- *
- * Returns:
- *		SERIAL_OK on success
- *		SERIAL_ERROR if buffer was locked
- *
- * New top+1 byte is set to 0
- ************************************************************************/
+	while (1) {
 
-static return_code_t shift_buffer_down(volatile struct buffer *buffer)
-{
+		if (channel->producer != NULL) {
+			data = channel->producer(channel->context);
+			if (data >= 0) {
+				channel->byte = data;
+				return 1;
+			}
+			channel->producer = NULL;
+		}
 
-	return_code_t retval = SERIAL_ERROR;
-	uint8_t i = 0;
+		if (channel->flash != NULL) {
+			data = pgm_read_byte(channel->flash++);
+			if (data) {
+				channel->byte = data;
+				return 1;
+			}
+			channel->flash = NULL;
+		}
 
-	if (!buffer->lock) {
+		descriptor_tail = channel->descriptor_tail;
+		if (descriptor_tail == channel->descriptor_head ||
+			channel->descriptors[descriptor_tail].position != channel->buffer.tail)
+			break;
 
-		buffer->lock = 1;
-		for (i=0; i < buffer->top ; i++) {
-			buffer->data[i] = buffer->data[i+1];
+		if (channel->descriptors[descriptor_tail].producer != NULL) {
+			channel->producer = channel->descriptors[descriptor_tail].producer;
+			channel->context = (void *) channel->descriptors[descriptor_tail].data;
+		} else {
+			channel->flash = channel->descriptors[descriptor_tail].data;
 		}
-		buffer->data[(buffer->top)--] = 0;
-		buffer->lock = 0;
-		retval = SERIAL_OK;
+		channel->descriptor_tail = (descriptor_tail + 1) & TX_DESCRIPTOR_MASK;
 
 	}
 
-	return retval;
+	if (buffer_empty(&channel->buffer)) {
+#ifdef SERIAL_EVENTS
+		// Nothing else queued: the next event frame, if there is one
+		if (channel == tx_channels && event_source != NULL) {
+			data = event_source(event_context);
+			if (data >= 0) {
+				channel->byte = data;
+				event_active = 1;
+				return 1;
+			}
+		}
+#endif
+		return 0;
+	}
+
+	// Take the byte out now, so its slot is free for the whole frame
+	channel->byte = channel->buffer.data[channel->buffer.tail];
+	channel->buffer.tail = (channel->buffer.tail + 1) & TX_BUFFER_MASK;
+
+	return 1;
 
 }
 
@@ -204,468 +671,1365 @@ static return_code_t shift_buffer_down(volatile struct buffer *buffer)
  *
  * Parameters:
  *		struct buffer *buffer	The receive buffer
+ *		uint8_t data			The byte received
  *
  * Returns:
  *		SERIAL_OK on success
  *		SERIAL_ERROR on failure
- * Sets SERIAL_RECEIVE_OVERFLOW on overflow
+ * Counts the byte in rx_overflows if the buffer is full
  ************************************************************************/
 
 static return_code_t store_data(volatile struct buffer *buffer, uint8_t data)
 {
 
 	return_code_t retval = SERIAL_ERROR;
+	uint8_t head = buffer->head;
+	uint8_t next = (head + 1) & RX_BUFFER_MASK;
 
-	buffer->lock = 1;
+	if (next != buffer->tail) {
 
-	if (buffer->top < RX_BUFFER_SIZE) {
-
-		buffer->data[(buffer->top)++] = data;
+		buffer->data[head] = data;
+		buffer->head = next;
 		retval = SERIAL_OK;
 
 	} else {
 
 		// Drat
-		move_connection_state(
-			SERIAL_RECEIVING_DATA,
-			SERIAL_RECEIVE_OVERFLOW
-		);
-	}
+		rx_overflows++;
 
-	buffer->lock = 0;
+	}
 
 	return retval;
 
 }
 #endif
 
+#ifdef SERIAL_TX_USI
 /************************************************************************
- * connection_state_is: check connection state
+ * reverse_byte: mirror the bits in a byte
  *
- * Parameters:
- *		uint8_t expected_state	The expected connection state
- * 
- * Checks whether the serial connection state is in the state
- * expected_state
+ * The USI shifts out MSB first, a UART sends LSB first
  ************************************************************************/
- 
-static uint8_t connection_state_is(uint8_t expected_state)
+
+static uint8_t reverse_byte(uint8_t data)
 {
 
-	return connection_state & expected_state;
+	data = (data & 0xf0) >> 4 | (data & 0x0f) << 4;
+	data = (data & 0xcc) >> 2 | (data & 0x33) << 2;
+	data = (data & 0xaa) >> 1 | (data & 0x55) << 1;
+
+	return data;
 
 }
 
-#ifndef TX_ONLY
 /************************************************************************
- * (en|dis)able_rx_interrupt: start / stop RX start bit capture
+ * usi_load_first_half: put start bit and data bits 0 - 6 in the USI
  *
- * This starts/stops the pin change interrupt. It is running when no byte
- * is currently being received, to capture the next start bit
+ * DO follows bit 7 of USIDR as soon as it is written, so the start bit
+ * goes out right away. Timer0 restarts with it, so the start bit is a
+ * full bit period however late this runs. The rest is shifted out on 
+ * Timer0 compare match.
  ************************************************************************/
- 
-static void enable_rx_interrupt(void) {
-
-	GIMSK |= (1 << PCIE);
-
-}
 
-static void disable_rx_interrupt(void) {
+static void usi_load_first_half(void)
+{
 
-	GIMSK &= ~(1 << PCIE);
+	usi_reversed_byte = reverse_byte(tx_channels[0].byte);
+	USIDR = usi_reversed_byte >> 1;		// Bit 7 = 0: start bit
+	TCNT0 = 0;
+	USISR = (1 << USIOIF) | USI_COUNTER_FIRST_HALF;
+	usi_second_half = 1;
 
 }
 
 /************************************************************************
- * Pin change interrupt 0 ISR - capture start bit for RX
+ * USI counter overflow interrupt - transmit routine for the USI engine
+ *
+ * A UART frame is 10 bits and USIDR holds 8, so each byte is sent in two
+ * halves: start bit plus data bits 0 - 5, then data bits 6 and 7 plus the
+ * stop bit. That is two interrupts per byte instead of one per bit.
  *
- * This sets rx_sample_countdown to start data bit sampling some time in 
- * the future. For Timer1 counter values smaller then half the OCR value,
- * so when we receive the start bit in the first half of a bit cycle, we
- * wait 2 timer cycles for sampling, for other case 3 timer cycles.
- * In all cases, sampling after that is every other timer cycle.
- * I should include a nice drawing of this in the documentation
+ * Neither reload changes DO. The first half overflows with data bit 6 
+ * on DO, and the second half starts with that same bit in bit 7 of 
+ * USIDR, so this interrupt has a full bit period to get there. The 
+ * second half overflows with the stop bit on DO and ones behind it, so
+ * a late next byte only makes the stop bit longer.
  ************************************************************************/
 
-ISR(PCINT0_vect)
+ISR(USI_OVF_vect)
 {
 
-	// Save this immediately so we know what TCNT1 is now
-	// and not several clock cycles further down in the ISR
-	rx_start_bit_timecount = TCNT1;
+	if (usi_second_half) {
+
+		// Data bit 6 again, data bit 7, ones: stop bit
+		USIDR = (usi_reversed_byte << 6) | 0x3f;
+		USISR = (1 << USIOIF) | USI_COUNTER_SECOND_HALF;
+		usi_second_half = 0;
 
-	// Sanity check. This should be a start bit, so low
-	if (bit_is_set(RX_PORT, RX_PIN)) return;
+	} else if (fetch_tx_byte(tx_channels)) {
 
-	disable_rx_interrupt();
+		usi_load_first_half();
 
-	if (rx_start_bit_timecount < sample_offset_treshold[SERIAL_SPEED]) {
-		rx_sample_countdown = 2;
 	} else {
-		rx_sample_countdown = 3;
-	}
 
+		// Nothing left. Hand DO back to PORTB, which holds it high,
+		// and stop the clock
+		USICR = 0;
+		TCCR0B &= ~(1 << CS02 | 1 << CS01 | 1 << CS00);
+		tx_idle = 1;
 
-	move_connection_state(
-		SERIAL_IDLE,
-		SERIAL_RECEIVED_START_BIT
-	);
+	}
 
 }
-#endif
-
+#else
 /************************************************************************
- * Timer1 Compare Match A interrupt - main polling / transmit routine
+ * start_clock: start Timer1, if it is not running yet
  *
- * This function is fairly large, as it does essentially all the work of 
- * this library.
+ * Bit timing restarts from scratch: the first compare match is one full
+ * bit period from now. Interrupts must be disabled.
  ************************************************************************/
 
-ISR(TIM1_COMPA_vect)
+static void start_clock(void)
 {
 
-#ifndef TX_ONLY
-	// RX
-	if (connection_state_is(SERIAL_RECEIVED_START_BIT)) {
-
-		// Start sampling?
-		if (rx_sample_countdown-- == 0) {
- 
-			// Sample first bit
-			if (bit_is_set(RX_PORT, RX_PIN))
-				rx_byte |= (1 << rx_bit_counter);
-			rx_bit_counter++;
-			rx_phase = 0;
-			move_connection_state(
-				SERIAL_RECEIVED_START_BIT,
-				SERIAL_RECEIVING_DATA
-			);
-
-		} 
-
-	} else if (rx_phase && connection_state_is(SERIAL_RECEIVING_DATA)) {
-	
-		rx_phase = 0;
-
-		// Subsequent data bits or stop bit
-		switch (rx_bit_counter) {
-
-			case 8:
-
-				// Stop bit. If received, load data into
-				// the receive buffer. As this library is the only one
-				// with access, and shifting bytes out of the buffer is 
-				// done in the bottom handler of this interrupt, we can
-				// be sure no one else is accessing the buffer
-				if (bit_is_set(RX_PORT, RX_PIN)) {
-					rx_bit_counter = 0;
-					store_data(&rx_buffer, rx_byte);
-					rx_byte = 0;
-				} // Do nothing if this is not a stop bit
-				
-				// We're done with this byte, so let's wait for the next one. No rest for the wicked
-				move_connection_state(
-					SERIAL_RECEIVING_DATA,
-					SERIAL_IDLE
-				);
-				enable_rx_interrupt();
-
-				break;
+	if (TCCR1 & TIMER1_CS_MASK)
+		return;
 
-			default:
+	GTCCR |= (1 << PSR1);
+	TCNT1 = 0;
+	TIFR = (1 << OCF1A | 1 << OCF1B);
+	TCCR1 |= TIMER1_CS_BITS;
 
-				// Normal data bit
-				if (bit_is_set(RX_PORT, RX_PIN))
-					rx_byte |= (1 << rx_bit_counter);	
-				rx_bit_counter++;
+}
 
-				break;
-		}
+/************************************************************************
+ * stop_clock_if_idle: stop Timer1 when neither direction needs it
+ *
+ * Only to be called from the Timer1 interrupts, so an idle line costs
+ * no interrupts at all. With SERIAL_SYSTEM_TICK the clock always runs.
+ ************************************************************************/
 
-	} else {
+static void stop_clock_if_idle(void)
+{
 
-		rx_phase = 1;
+#ifndef SERIAL_SYSTEM_TICK
+#ifndef TX_ONLY
+	if (rx_active)
+		return;
+#endif
 
-	}  // if connection_state_is(SERIAL_RECEIVED_START_BIT)
+	if (tx_idle)
+		TCCR1 &= ~TIMER1_CS_MASK;
 #endif
-	
-	// TX
-	switch(tx_phase) {
 
-		case 0:
+}
 
-			tx_phase = 1;
-			break;
+/************************************************************************
+ * refill_tx: load the next frame of every channel that has none
+ *
+ * Called by the transmit interrupt once its bits are out, with 
+ * interrupts enabled, so fetch_tx_byte and producers do not hold up RX
+ * sampling and pin changes. A nested Compare Match A may shift the 
+ * frames meanwhile, so they are only read and written with interrupts
+ * off.
+ *
+ * When no channel has a frame, the transmitter is idle from before
+ * fetching. An interrupt that publishes data meanwhile sees that in 
+ * start_tx, so it is not missed, and the clock only stops if nothing
+ * came in.
+ ************************************************************************/
 
-		case 1: 
+static void refill_tx(void)
+{
 
-			tx_phase = 0;
-			if (connection_state_is(SERIAL_SENT_START_BIT)) {
+	struct tx_channel *channel;
+	uint16_t frame;
+	uint8_t busy = 0;
 
-				// Write first bit of data
-				send_data_bit(tx_bit_counter++);
-				move_connection_state(
-					SERIAL_SENT_START_BIT,
-					SERIAL_SENDING_DATA 
-				);
+	ATOMIC_BLOCK(ATOMIC_FORCEON) {
+		for (channel = tx_channels; channel < tx_channels + SERIAL_TX_CHANNELS; channel++)
+			if (channel->frame)
+				busy = 1;
+		if (!busy)
+			tx_idle = 1;
+	}
 
-			} else if (connection_state_is(SERIAL_SENDING_DATA)) {
+	for (channel = tx_channels; channel < tx_channels + SERIAL_TX_CHANNELS; channel++) {
 
-				// Data or stop bit
-				if (tx_bit_counter == 8) {
+		ATOMIC_BLOCK(ATOMIC_FORCEON) {
+			frame = channel->frame;
+		}
 
-					// Stop bit
-					TX_PORT |=(1 << TX_PIN);
+		// Start bit is the 0 shifted in at the bottom
+		if (frame == 0 && fetch_tx_byte(channel)) {
+			frame = ((uint16_t) channel->byte << 1) | TX_FRAME_STOP_BIT;
+			ATOMIC_BLOCK(ATOMIC_FORCEON) {
+				channel->frame = frame;
+			}
+		}
 
-					// Try to shift out the sent byte
-					if (shift_buffer_down(&tx_buffer) == SERIAL_OK) {
-						move_connection_state(
-							SERIAL_SENDING_DATA,
-							SERIAL_IDLE
-						);
-					} else {
-						// Drat. Try again later
-						move_connection_state(
-							SERIAL_SENDING_DATA,
-							SERIAL_TX_BUFFER_LOCKED
-						);
-					}
+		if (frame)
+			busy = 1;
 
-				} else {
+	}
 
-					// Data bit
-					send_data_bit(tx_bit_counter++);
+	ATOMIC_BLOCK(ATOMIC_FORCEON) {
 
-				}
+		if (busy) {
+			// RX may have stopped the clock meanwhile. The new frame
+			// has not started, so restarting it stretches nothing
+			tx_idle = 0;
+			start_clock();
+		} else if (tx_idle) {
+			stop_clock_if_idle();
+		}
 
-			} else if (connection_state_is(SERIAL_TX_BUFFER_LOCKED)) {
+	}
 
-				// Keep trying to shift TX buffer
-				if (shift_buffer_down(&tx_buffer) == SERIAL_OK) {
-					move_connection_state(
-						SERIAL_SENDING_DATA,
-						SERIAL_IDLE
-					);
-				}	
+}
 
-			} else {
+/************************************************************************
+ * Timer1 Compare Match A interrupt - transmit routine, one bit per call
+ *
+ * Timer1 runs at the bit rate. Each byte is turned into a 10 bit frame
+ * once, after which every bit costs a shift. The bits of all channels 
+ * are collected and written to the port at once, so all TX pins change
+ * together and an extra channel costs a few cycles, not an interrupt.
+ *
+ * Frames are loaded ahead by refill_tx, so the bits go out first thing,
+ * and everything else runs with interrupts enabled, SERIAL_TICK_HANDLER
+ * included. A frame loaded 
+ * after a stop bit starts on the next interrupt, so the stop bit lasts
+ * a full bit period. After idle, the first start bit goes out one bit
+ * period after the first interrupt.
+ ************************************************************************/
 
-				// Not sending anything. Check for byte to send. Not using dirty
-				// flag as top != 0 means the same thing for TX buffer
-				if (tx_buffer.top) {
+ISR(TIM1_COMPA_vect)
+{
 
-					// New data
-					TX_PORT &= ~(1 << TX_PIN);  // Start bit
-					tx_byte = tx_buffer.data[0];
-					tx_bit_counter = 0;
-					move_connection_state(
-						SERIAL_IDLE,
-						SERIAL_SENT_START_BIT
-					);
+	struct tx_channel *channel = tx_channels;
+	uint16_t frame;
+	uint8_t out = 0;
 
-				}
+	do {
 
-			}
+		frame = channel->frame;
 
-			break; // tx_phase 1
+		if (frame) {
+			if (frame & 1)
+				out |= channel->mask;
+			channel->frame = frame >> 1;
+		} else {
+			out |= channel->mask;	// Idle line is high
+		}
 
-	} // switch(tx_phase)
+	} while (++channel < tx_channels + SERIAL_TX_CHANNELS);
 
-	// Bottom handler: RX buffer 
-	if (rx_buffer.dirty) {
+#if SERIAL_TX_CHANNELS == 1
+	// A constant pin: sbi / cbi, which leave the rest of PORTB alone
+	if (out)
+		TX_PORT |= (1 << TX_PIN);
+	else
+		TX_PORT &= ~(1 << TX_PIN);
+#else
+	TX_PORT = (TX_PORT & ~TX_PINS_MASK) | out;
+#endif
 
-		shift_buffer_down(&rx_buffer);
-		rx_buffer.dirty = 0;
+#ifdef SERIAL_SYSTEM_TICK
+	if (!--system_tick_counter) {
+		system_tick_counter = SYSTEM_TICK_BITS;
+		system_ticks_due++;
+	}
+#endif
 
+	// The rest can wait for RX and for the next bit
+	if (tx_refilling)
+		return;
+	tx_refilling = 1;
+	sei();
+	refill_tx();
+
+#ifdef SERIAL_SYSTEM_TICK
+	// After the frames, so a slow handler holds up no bits. A tick that
+	// comes in from here on is counted, and handled next time
+	while (system_ticks_due) {
+		ATOMIC_BLOCK(ATOMIC_FORCEON) {
+			system_ticks_due--;
+		}
+		SERIAL_TICK_HANDLER();
 	}
+#endif
+
+	tx_refilling = 0;
 
 }
 
+#ifndef TX_ONLY
 /************************************************************************
- * acquire_buffer_lock		Buffer locking functions
- * release_buffer_lock
+ * sample_rx_bit: read the RX pin, majority of 3
  *
- * Parameters:
- * 		struct buffer *buffer	The buffer to be locked / released
- * 
- * These functions lock, resp. unlock a buffer. These are not intended
- * to be called from interrupt, only from the non-interrupt functions
+ * The three reads are RX_SAMPLE_SPACING cycles apart around the bit
+ * centre, so a single short spike on the line does not flip the bit.
  ************************************************************************/
 
-static void acquire_buffer_lock(volatile struct buffer *buffer)
+static uint8_t sample_rx_bit(void)
 {
 
-	// Spin for lock
-	while(buffer->lock);
+	uint8_t ones = 0;
 
-	// Temporarily disable interrupts to make sure we are not 
-	// bothered while setting the lock
-	cli();
-	buffer->lock = 1;
-	sei();
+	if (bit_is_set(RX_PORT, RX_PIN))
+		ones++;
+	__builtin_avr_delay_cycles(RX_SAMPLE_SPACING);
+	if (bit_is_set(RX_PORT, RX_PIN))
+		ones++;
+	__builtin_avr_delay_cycles(RX_SAMPLE_SPACING);
+	if (bit_is_set(RX_PORT, RX_PIN))
+		ones++;
+
+	return ones >= 2;
 
 }
 
-static void release_buffer_lock(volatile struct buffer *buffer)
+/************************************************************************
+ * end_rx_frame: stop sampling and wait for the next start bit
+ *
+ * A pin change flag raised by the data bits may still be pending. That
+ * is harmless: the pin change handler ignores a high line.
+ ************************************************************************/
+
+static void end_rx_frame(void)
 {
 
-	// No need to disable interrupts here. Interrupts never return
-	// leaving a lock of their own doing set, so no risk of accidentally
-	// unlocking a buffer that should stay locked
-	buffer->lock = 0;
+	TIMSK &= ~(1 << OCIE1B);
+	if (rx_enabled)
+		PCMSK |= (1 << RX_PIN);
+	rx_active = 0;
+	stop_clock_if_idle();
 
 }
 
+#ifdef SERIAL_AUTOBAUD
 /************************************************************************
- * Public functions
- ************************************************************************/
-
-/************************************************************************
- * serial_initialise: set up connection
- * 
- * Parameters: none
+ * autobaud_lock: switch to the rate nearest to a measured sync byte
  *
- * Returns:
- *	  SERIAL_ERROR on error
- *	  SERIAL_OK otherwise
+ * Parameters:
+ *		uint16_t length		Start bit edge to last falling edge, in
+ *							measuring counts: eight bit periods
  *
- * This function:
- *  - Mallocs rx & tx buffers
- *  - Sets up the I/O ports
- *  - Sets up the frame receive interrupt
- *  - Sets up & starts the timer to provide the 'clock'
+ * Returns:
+ *		1 if a rate was picked, 0 if none is within about 6 %
  *
- * Possible errors are:
- * 	- Not enough memory for buffers
- *  - Timer already running, so UART connection already started
- *  - No PCINT interrupt possible on RX pin   
+ * Timer1 goes back to counting bits, and TX starts. Anything queued
+ * while measuring goes out, otherwise the transmit interrupt finds 
+ * nothing and stops the clock again.
  ************************************************************************/
 
-
-extern return_code_t serial_initialise()
+static uint8_t autobaud_lock(uint16_t length)
 {
 
+	struct autobaud_rate rate;
+	struct autobaud_rate best;
+	uint16_t error;
+	uint16_t best_error = 0xffff;
+	uint8_t i;
 
-	uint8_t *rxd;
-	uint8_t *txd;
+	for (i = 0; i < sizeof(autobaud_rates) / sizeof(autobaud_rates[0]); i++) {
 
+		memcpy_P(&rate, &autobaud_rates[i], sizeof(rate));
+		if (length > rate.sync_counts)
+			error = length - rate.sync_counts;
+		else
+			error = rate.sync_counts - length;
 
-	// Sanity checks. Timer running?
-	if (TCCR1 & 0x0f)
-		return SERIAL_ERROR;
+		if (error < best_error) {
+			best_error = error;
+			best = rate;
+		}
 
-	// Allocate buffers
-	if ((rxd = malloc(RX_BUFFER_SIZE)) == NULL)
-		return SERIAL_ERROR;
+	}
 
-	if ((txd = malloc(TX_BUFFER_SIZE)) == NULL)
-		return SERIAL_ERROR;
+	if (best_error > best.sync_counts / 16)
+		return 0;
 
-	rx_buffer.data = rxd;
-	tx_buffer.data = txd;
+	TIMSK &= ~(1 << TOIE1);
+	TCCR1 = (1 << CTC1);		// Stopped, clear on reaching OCR1C
+	OCR1A = OCR1C = best.counts - 1;
+	timer1_prescaler_bits = best.prescaler_bits;
+	rx_half_bit_counts = best.half_bit;
+	baud_rate = best.baud;
+	autobaud_edges = AUTOBAUD_LOCKED;
 
-	// Setup I/O
-	if (setup_io(&TX_PORT, TX_PIN, SERIAL_DIR_TX) != SERIAL_OK)
-		return SERIAL_ERROR;
+	TIMSK |= (1 << OCIE1A);
+	tx_idle = 0;
+	start_clock();
 
-#ifndef TX_ONLY
-	if (setup_io(&RX_PORT, RX_PIN, SERIAL_DIR_RX) != SERIAL_OK)
-		return SERIAL_ERROR;
+	return 1;
 
-	// Setup interrupt: frame receive: pin change interrupt on RX pin
-	PCMSK |= (1 << RX_PIN); // Bit positions in PCMSK match pin numbers
-#endif
-	
-	// Setup interrupt: Compare Match A interrupt Timer1
-	TIMSK |= (1 << OCIE1A);	
+}
 
-	// Setup timer
-	// CTC Mode (clear on reaching OCR1C)
-	TCCR1 |= (1 << CTC1); 
-	OCR1A = OCR1C = timer_ocr_values[SERIAL_SPEED];
+/************************************************************************
+ * autobaud_edge: time a pin change while measuring
+ *
+ * Parameters:
+ *		uint8_t count	TCNT1 as read on entry to the interrupt
+ *
+ * 0x55 is sent as start bit, 1, 0, 1, 0, 1, 0, 1, 0, stop bit: five 
+ * falling edges two bit periods apart. When the spacing changes, the
+ * edge before may have been the start bit of the real sync byte, so 
+ * measuring starts over from there.
+ ************************************************************************/
+
+static void autobaud_edge(uint8_t count)
+{
+
+	uint8_t overflows = autobaud_overflows;
+	uint16_t now;
+	uint16_t gap;
+
+	// An overflow just before count was read is still pending
+	if ((TIFR & (1 << TOV1)) && count < 0x80)
+		overflows++;
+	now = (uint16_t) overflows << 8 | count;
+
+	if (bit_is_set(RX_PORT, RX_PIN))
+		return;		// Only falling edges are timed
+
+	gap = now - autobaud_last;
+	autobaud_last = now;
+
+	// Line was idle: this may be the start bit
+	if (autobaud_edges == 0 || gap > AUTOBAUD_MAX_GAP) {
+		autobaud_first = now;
+		autobaud_edges = 1;
+		return;
+	}
+
+	// Spacing changed: the previous edge may have been the start bit
+	if (autobaud_edges == 1 || gap > autobaud_gap + autobaud_gap / 4 ||
+			gap < autobaud_gap - autobaud_gap / 4) {
+		autobaud_first = now - gap;
+		autobaud_gap = gap;
+		autobaud_edges = 2;
+		return;
+	}
+
+	if (++autobaud_edges == AUTOBAUD_SYNC_EDGES &&
+			!autobaud_lock(now - autobaud_first)) {
+		autobaud_first = now;
+		autobaud_edges = 1;
+	}
+
+}
+
+/************************************************************************
+ * Timer1 overflow interrupt - high byte of the time while measuring
+ ************************************************************************/
+
+ISR(TIM1_OVF_vect)
+{
+
+	autobaud_overflows++;
+
+}
+#endif
+
+/************************************************************************
+ * Pin change interrupt - capture start bit for RX
+ *
+ * Sets Compare Match B to fire in the middle of the start bit, and from
+ * then on every bit period, in the middle of each next bit. This works
+ * whatever phase Timer1 is in for TX. If Timer1 was stopped, it is 
+ * started here.
+ *
+ * With SERIAL_SHARED_PCINT this is a plain function, to be called from
+ * an application ISR(PCINT0_vect) that also serves other pins.
+ ************************************************************************/
+
+#ifdef SERIAL_SHARED_PCINT
+extern void serial_pin_change(void)
+#else
+ISR(PCINT0_vect)
+#endif
+{
+
+	// Save this immediately so we know what TCNT1 is now
+	// and not several clock cycles further down in the ISR
+	uint8_t now = TCNT1;
+	uint8_t sample;
+
+	// Sanity check. This should be a start bit, so low, and not in
+	// the middle of a frame
+#ifdef SERIAL_AUTOBAUD
+	if (autobaud_edges != AUTOBAUD_LOCKED) {
+		autobaud_edge(now);
+		return;
+	}
+#endif
+
+	if (rx_active || bit_is_set(RX_PORT, RX_PIN))
+		return;
+
+	rx_active = 1;
+	PCMSK &= ~(1 << RX_PIN);	// Data bits are sampled, not edge driven
+
+	if (!(TCCR1 & TIMER1_CS_MASK)) {
+		start_clock();
+		now = 0;
+	}
+
+	// Timer1 counts 0 .. OCR1C, so wrap around there
+	sample = now + RX_HALF_BIT;
+	if (sample > OCR1C || sample < now)
+		sample -= OCR1C + 1;
+
+	rx_bit_counter = 0;
+	OCR1B = sample;
+	TIFR = (1 << OCF1B);
+	TIMSK |= (1 << OCIE1B);
+
+}
+
+/************************************************************************
+ * Timer1 Compare Match B interrupt - receive routine, one bit per call
+ ************************************************************************/
+
+ISR(TIM1_COMPB_vect)
+{
+
+	uint8_t bit = sample_rx_bit();
+	uint8_t counter = rx_bit_counter;
+
+	if (counter == 0) {
+
+		// Start bit gone by the time we look: a glitch, not a frame
+		if (bit) {
+			end_rx_frame();
+			return;
+		}
+
+	} else if (counter <= 8) {
+
+		// Data bits, LSB first
+		rx_byte >>= 1;
+		if (bit)
+			rx_byte |= 0x80;
+
+	} else {
+
+		// Stop bit. If received, load data into the receive buffer
+		if (bit) {
+			store_data(&rx_buffer, rx_byte);
+		} else {
+			rx_framing_errors++;
+		}
+
+		// We're done with this byte, so let's wait for the next one.
+		// No rest for the wicked
+		end_rx_frame();
+		return;
+
+	}
+
+	rx_bit_counter = counter + 1;
+
+}
+#endif
+#endif
+
+/************************************************************************
+ * start_tx: make sure the transmitter picks up newly queued data
+ *
+ * The TX clock is stopped when there is nothing to do and is restarted
+ * here. This only touches the hardware on the idle to busy transition,
+ * and needs to be called after the new data has been published. If RX
+ * is keeping Timer1 running, the first start bit simply goes out on the
+ * next compare match.
+ ************************************************************************/
+
+static void start_tx(void)
+{
+
+	// Cheap check first: no need for an atomic block when busy. The 
+	// interrupt only goes idle when it finds nothing to send, and the 
+	// caller has already published something
+	if (!tx_idle)
+		return;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+
+#ifdef SERIAL_TX_USI
+		// The USI interrupt is off while idle, so fetching here is safe
+		if (tx_idle && fetch_tx_byte(tx_channels)) {
+
+			tx_idle = 0;
+			usi_load_first_half();
+			USICR = (1 << USIOIE | 1 << USIWM0 | 1 << USICS0);
+			TCCR0B |= USI_PRESCALER_BITS;
+
+		}
+#else
+		// While autobaud measures, data waits for autobaud_lock
+		if (tx_idle
+#ifdef SERIAL_AUTOBAUD
+				&& autobaud_edges == AUTOBAUD_LOCKED
+#endif
+				) {
+
+			tx_idle = 0;
+			start_clock();
+
+		}
+#endif
+
+	}
+
+}
+
+/************************************************************************
+ * queue_descriptor: queue a flash string or producer for sending
+ *
+ * Parameters:
+ *		serial_producer_t producer	Producer, NULL for a flash string
+ *		const void *data			Flash string or producer context
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if all TX descriptors are in use
+ ************************************************************************/
+
+static return_code_t queue_descriptor(
+				serial_producer_t producer,
+				const void *data
+				)
+{
+
+	uint8_t head = tx_current->descriptor_head;
+	uint8_t next = (head + 1) & TX_DESCRIPTOR_MASK;
+
+	if (next == tx_current->descriptor_tail)
+		return SERIAL_ERROR;
+
+	tx_current->descriptors[head].position = tx_current->buffer.head;
+	tx_current->descriptors[head].producer = producer;
+	tx_current->descriptors[head].data = data;
+	tx_current->descriptor_head = next;	// Publish only after the descriptor is in
+
+	start_tx();
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * Number formatting
+ *
+ * Digits are written straight into the TX buffer and published with a 
+ * single head update, so a number is queued either whole or not at all.
+ * Decimal digits are found by repeated subtraction of powers of 10, as
+ * the AVR has no divide instruction.
+ ************************************************************************/
+
+static const uint32_t powers_of_10[] PROGMEM = {
+	1000000000, 100000000, 10000000, 1000000, 100000,
+	10000, 1000, 100, 10
+};
+
+#define POWERS_OF_10	(sizeof(powers_of_10) / sizeof(powers_of_10[0]))
+
+/************************************************************************
+ * tx_room: number of bytes that can be added to the TX buffer
+ ************************************************************************/
+
+static uint8_t tx_room(void)
+{
+
+	return (tx_current->buffer.tail - tx_current->buffer.head - 1) & TX_BUFFER_MASK;
+
+}
+
+/************************************************************************
+ * put_decimal: queue a number in decimal
+ *
+ * Parameters:
+ *		uint32_t value		Magnitude of the number
+ *		uint8_t negative	Nonzero to put a minus sign in front
+ *		uint8_t width		Minimum field width, 0 for none
+ *		char pad			Fill character for the field: ' ' pads
+ *							before the sign, '0' after it
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the buffer does not have room for all of it
+ ************************************************************************/
+
+static return_code_t put_decimal(
+				uint32_t value,
+				uint8_t negative,
+				uint8_t width,
+				char pad
+				)
+{
+
+	volatile uint8_t *buffer = tx_current->buffer.data;
+	uint8_t head = tx_current->buffer.head;
+	uint8_t first = POWERS_OF_10;
+	uint8_t length;
+	uint8_t digit;
+	uint32_t power;
+
+	// Count the digits: compares only
+	while (first > 0 && value >= pgm_read_dword(&powers_of_10[first - 1]))
+		first--;
+
+	length = POWERS_OF_10 + 1 - first + (negative ? 1 : 0);
+	if (width < length)
+		width = length;
+	if (width > tx_room())
+		return SERIAL_ERROR;
+
+	if (negative && pad == '0') {
+		buffer[head] = '-';
+		head = (head + 1) & TX_BUFFER_MASK;
+		negative = 0;
+	}
+
+	while (width-- > length) {
+		buffer[head] = pad;
+		head = (head + 1) & TX_BUFFER_MASK;
+	}
+
+	if (negative) {
+		buffer[head] = '-';
+		head = (head + 1) & TX_BUFFER_MASK;
+	}
+
+	for (; first < POWERS_OF_10; first++) {
+		power = pgm_read_dword(&powers_of_10[first]);
+		digit = '0';
+		while (value >= power) {
+			value -= power;
+			digit++;
+		}
+		buffer[head] = digit;
+		head = (head + 1) & TX_BUFFER_MASK;
+	}
+
+	buffer[head] = '0' + value;
+	head = (head + 1) & TX_BUFFER_MASK;
+
+	tx_current->buffer.head = head;	// Publish only after the data is in
+	start_tx();
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * put_hex: queue a number as a fixed number of hex digits
+ *
+ * Parameters:
+ *		uint32_t value		The number
+ *		uint8_t digits		Number of digits, 1 - 8
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the buffer does not have room for all of it
+ ************************************************************************/
+
+static return_code_t put_hex(uint32_t value, uint8_t digits)
+{
+
+	volatile uint8_t *buffer = tx_current->buffer.data;
+	uint8_t head = tx_current->buffer.head;
+	uint8_t nibble;
+
+	if (digits > tx_room())
+		return SERIAL_ERROR;
+
+	// Move the first digit to the top, then take them off one by one
+	value <<= (8 - digits) * 4;
+
+	while (digits--) {
+		nibble = value >> 28;
+		value <<= 4;
+		buffer[head] = nibble < 10 ? '0' + nibble : 'a' - 10 + nibble;
+		head = (head + 1) & TX_BUFFER_MASK;
+	}
+
+	tx_current->buffer.head = head;	// Publish only after the data is in
+	start_tx();
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * Public functions
+ ************************************************************************/
+
+/************************************************************************
+ * serial_initialise: set up connection
+ * 
+ * Parameters: none
+ *
+ * Returns:
+ *	  SERIAL_ERROR on error
+ *	  SERIAL_OK otherwise
+ *
+ * This function:
+ *  - Mallocs rx & tx buffers
+ *  - Sets up the I/O ports
+ *  - Sets up the frame receive interrupt, which is only enabled by
+ *    serial_enable_receive
+ *  - Sets up the timer to provide the 'clock'. The timer only runs
+ *    while there is data to send or a frame is being received
+ *
+ * Possible errors are:
+ * 	- Not enough memory for buffers
+ *  - Timer already running, so UART connection already started
+ *  - No PCINT interrupt possible on RX pin   
+ ************************************************************************/
+
+
+extern return_code_t serial_initialise()
+{
+
+
+#ifndef TX_ONLY
+	uint8_t *rxd;
+#endif
+	uint8_t *txd;
+	uint8_t channel;
+
+
+	// Sanity checks. Already initialised? Timer running?
+	if (connection_state != SERIAL_NOT_INITIALISED)
+		return SERIAL_ERROR;
+
+#ifdef SERIAL_TX_USI
+	if (TCCR0B & (1 << CS02 | 1 << CS01 | 1 << CS00))
+		return SERIAL_ERROR;
+#else
+	if (TCCR1 & 0x0f)
+		return SERIAL_ERROR;
+#endif
+
+	// Allocate buffers
+#ifndef TX_ONLY
+	if ((rxd = malloc(RX_BUFFER_SIZE)) == NULL)
+		return SERIAL_ERROR;
+
+	rx_buffer.data = rxd;
+#endif
+
+	for (channel = 0; channel < SERIAL_TX_CHANNELS; channel++) {
+
+		if ((txd = malloc(TX_BUFFER_SIZE)) == NULL)
+			return SERIAL_ERROR;
+
+		tx_channels[channel].buffer.data = txd;
+
+	}
+
+	// Setup I/O
+#ifdef SERIAL_TX_USI
+	if (setup_io(&TX_PORT, TX_PIN, SERIAL_DIR_TX) != SERIAL_OK)
+		return SERIAL_ERROR;
+#else
+	for (channel = 0; channel < SERIAL_TX_CHANNELS; channel++) {
+
+		if (setup_io(&TX_PORT, tx_channel_pins[channel], SERIAL_DIR_TX) != SERIAL_OK)
+			return SERIAL_ERROR;
+
+		tx_channels[channel].mask = (1 << tx_channel_pins[channel]);
+
+	}
+#endif
+
+#ifndef TX_ONLY
+	if (setup_io(&RX_PORT, RX_PIN, SERIAL_DIR_RX) != SERIAL_OK)
+		return SERIAL_ERROR;
+
+	// Setup interrupt: frame receive: pin change interrupt on RX pin. 
+	// The pin itself is added to PCMSK by serial_enable_receive
+	GIMSK |= (1 << PCIE);
+#endif
+	
+#ifdef SERIAL_TX_USI
+	// Setup timer. Timer0 in CTC mode clocks the USI at the bit rate. It
+	// is only started when there is something to send
+	TCCR0A = (1 << WGM01);
+	TCCR0B = 0;
+	OCR0A = USI_TIMER_COUNTS - 1;
+#else
+#ifdef SERIAL_TIMER1_PLL
+	// Clock Timer1 from the PLL. Let it settle and lock before 
+	// switching over - datasheet p.97
+	PLLCSR |= (1 << PLLE);
+	_delay_us(100);
+	loop_until_bit_is_set(PLLCSR, PLOCK);
+	PLLCSR |= (1 << PCKE);
+#endif
+
+	// Setup interrupt: Compare Match A interrupt Timer1
+	TIMSK |= (1 << OCIE1A);	
+
+	// Setup timer
+	// CTC Mode (clear on reaching OCR1C)
+	TCCR1 |= (1 << CTC1); 
+	OCR1A = OCR1C = TIMER1_COUNTS_PER_BIT - 1;
+
+	// Timer is left stopped. start_tx or an incoming start bit starts it
+	// - datasheet p.89 table 12-5
+	TCCR1 &= ~TIMER1_CS_MASK;
+#ifdef SERIAL_SYSTEM_TICK
+	// Except when it is the system tick as well
+	start_clock();
+#endif
+#endif
+
+	connection_state = SERIAL_IDLE;
+
+	// Let's go
+	sei();
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * serial_select_channel: pick the TX channel to send on
+ *
+ * Parameters:
+ *		uint8_t channel		0 - SERIAL_TX_CHANNELS - 1
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if there is no such channel
+ *
+ * All TX functions work on the selected channel, 0 by default.
+ ************************************************************************/
+
+extern return_code_t serial_select_channel(uint8_t channel)
+{
+
+	if (channel >= SERIAL_TX_CHANNELS)
+		return SERIAL_ERROR;
+
+#if SERIAL_TX_CHANNELS > 1
+	tx_current = &tx_channels[channel];
+#endif
+
+	return SERIAL_OK;
+
+}
+
+/************************************************************************
+ * serial_put_char: send a single byte
+ *
+ * Parameters:
+ *		uint8_t data		Byte to send
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the buffer is full
+ *
+ * This function never blocks and never disables interrupts.
+ ************************************************************************/
+
+extern return_code_t serial_put_char(uint8_t data)
+{
+
+	return_code_t retval = SERIAL_ERROR;
+	uint8_t head;
+	uint8_t next;
+
+	head = tx_current->buffer.head;
+	next = (head + 1) & TX_BUFFER_MASK;
+	if (next != tx_current->buffer.tail) {
+		tx_current->buffer.data[head] = data;
+		tx_current->buffer.head = next;	// Publish only after the data is in
+		retval = SERIAL_OK;
+		start_tx();
+	}
+
+	return retval;
+
+}
+
+/************************************************************************
+ * serial_send_data: Send multiple byte serial data
+ *
+ * Parameters:
+ *		char *data	The data to be sent
+ *
+ * Returns:
+ *		Number of bytes sent out. This could be less than length, as the
+ *		buffer might be full or some other error might have occured
+ ************************************************************************/
+
+extern uint16_t serial_send_data(char *data)
+{
+
+	return serial_write((const uint8_t *) data, strlen(data));
+
+}
+
+/************************************************************************
+ * serial_write: Send a block of binary data
+ *
+ * Parameters:
+ *		const uint8_t *data	The data to be sent, may contain 0 bytes
+ *		uint16_t length		Number of bytes to send
+ *
+ * Returns:
+ *		Number of bytes queued. This is less than length if the buffer
+ *		did not have room for all of it.
+ *
+ * The data is copied in one pass, in at most two chunks (up to the end
+ * of the ring, then from its start), and published with a single head
+ * update.
+ ************************************************************************/
+
+extern uint16_t serial_write(const uint8_t *data, uint16_t length)
+{
+
+	volatile uint8_t *buffer = tx_current->buffer.data;
+	uint8_t head = tx_current->buffer.head;
+	uint8_t space = (tx_current->buffer.tail - head - 1) & TX_BUFFER_MASK;
+	uint16_t chunk;
+	uint16_t written;
+
+	if (length > space)
+		length = space;
+	written = length;
+
+	while (length) {
+
+		chunk = TX_BUFFER_SIZE - head;
+		if (chunk > length)
+			chunk = length;
+		length -= chunk;
+
+		while (chunk--)
+			buffer[head++] = *data++;
+		head &= TX_BUFFER_MASK;
+
+	}
+
+	tx_current->buffer.head = head;	// Publish only after the data is in
+
+	if (written)
+		start_tx();
+
+	return written;
+
+}
+
+/************************************************************************
+ * serial_tx_room: Free space in the TX buffer
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		Number of bytes serial_write will take right now
+ ************************************************************************/
+
+extern uint8_t serial_tx_room()
+{
+
+	return tx_room();
+
+}
+
+/************************************************************************
+ * serial_send_P: Send a string from flash without copying it
+ *
+ * Parameters:
+ *		PGM_P data	The string to be sent, e.g. PSTR("Hello")
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if all TX descriptors are in use
+ *
+ * Only a reference to the string is queued. The Timer1 interrupt reads 
+ * it straight from flash when its turn comes, so it takes no SRAM and
+ * can be longer than TX_BUFFER_SIZE. Ordering with data queued through
+ * the other functions is kept.
+ ************************************************************************/
+
+extern return_code_t serial_send_P(PGM_P data)
+{
 
-	// Start timer. /8 prescaler - datasheet p.89 table 12-5
-	TCCR1 &= ~(1 << CS13 | 1 << CS12 | 1 << CS11 | 1 << CS10);
-	TCCR1 |= (1 << CS12);
+	return queue_descriptor(NULL, data);
 
-	connection_state = SERIAL_IDLE;
+}
 
-	// Let's go
-	sei();
+/************************************************************************
+ * serial_send_stream: Send data generated on demand
+ *
+ * Parameters:
+ *		serial_producer_t producer	Called for every byte to send
+ *		void *context				Passed to producer as is
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if all TX descriptors are in use
+ *
+ * When its turn comes, the Timer1 interrupt calls producer for each
+ * next byte until it returns a negative value. Nothing is buffered.
+ ************************************************************************/
 
-	return SERIAL_OK;
+extern return_code_t serial_send_stream(
+				serial_producer_t producer,
+				void *context
+				)
+{
+
+	if (producer == NULL)
+		return SERIAL_ERROR;
+
+	return queue_descriptor(producer, context);
 
 }
 
+#ifdef SERIAL_EVENTS
 /************************************************************************
- * serial_put_char: send a single byte
+ * serial_set_event_source: Send frames generated by an interrupt
  *
  * Parameters:
- *		uint8_t data		Byte to send
+ *		serial_producer_t producer	Called for every byte to send, NULL
+ *									to remove the event source
+ *		void *context				Passed to producer as is
+ *
+ * The source is polled by fetch_tx_byte whenever channel 0 has nothing
+ * else to send. It returns -1 both when it has nothing and at the end 
+ * of each frame, so queued data gets a turn between frames.
+ ************************************************************************/
+
+extern void serial_set_event_source(serial_producer_t producer, void *context)
+{
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		event_source = producer;
+		event_context = context;
+		event_active = 0;
+	}
+
+}
+
+/************************************************************************
+ * serial_event_ready: the event source has a new frame
+ *
+ * Only restarts the transmitter if it is idle, so it is cheap enough for
+ * the interrupt that produced the event.
+ ************************************************************************/
+
+extern void serial_event_ready(void)
+{
+
+	start_tx();
+
+}
+#endif
+
+/************************************************************************
+ * serial_write_blocking: Send a block of binary data, waiting for room
+ *
+ * Parameters:
+ *		const uint8_t *data	The data to be sent, may contain 0 bytes
+ *		uint16_t length		Number of bytes to send
+ *
+ * Returns: nothing. All data has been queued when this returns.
+ *
+ * While the buffer is full, the CPU sleeps in idle mode until the next
+ * interrupt rather than spinning. Interrupts must be enabled, and this 
+ * must not be called from an interrupt.
+ ************************************************************************/
+
+extern void serial_write_blocking(const uint8_t *data, uint16_t length)
+{
+
+	uint16_t written;
+
+	while (length) {
+
+		written = serial_write(data, length);
+		data += written;
+		length -= written;
+
+		if (length) {
+			set_sleep_mode(SLEEP_MODE_IDLE);
+			sleep_mode();
+		}
+
+	}
+
+}
+
+/************************************************************************
+ * serial_put_(u|s)(8|16|32): Send a number in decimal
+ *
+ * Parameters:
+ *		value			The number
  *
  * Returns:
  *		SERIAL_OK on success
- *		SERIAL_ERROR on failure
+ *		SERIAL_ERROR if the buffer is too full. Nothing is queued then.
+ *
+ * The digits go straight into the TX buffer, no string is built first.
+ ************************************************************************/
+
+extern return_code_t serial_put_u8(uint8_t value)
+{
+
+	return put_decimal(value, 0, 0, ' ');
+
+}
+
+extern return_code_t serial_put_u16(uint16_t value)
+{
+
+	return put_decimal(value, 0, 0, ' ');
+
+}
+
+extern return_code_t serial_put_u32(uint32_t value)
+{
+
+	return put_decimal(value, 0, 0, ' ');
+
+}
+
+extern return_code_t serial_put_s8(int8_t value)
+{
+
+	return serial_put_s32_padded(value, 0, ' ');
+
+}
+
+extern return_code_t serial_put_s16(int16_t value)
+{
+
+	return serial_put_s32_padded(value, 0, ' ');
+
+}
+
+extern return_code_t serial_put_s32(int32_t value)
+{
+
+	return serial_put_s32_padded(value, 0, ' ');
+
+}
+
+/************************************************************************
+ * serial_put_(u|s)32_padded: Send a number in decimal, in a fixed width
  *
+ * Parameters:
+ *		value			The number
+ *		uint8_t width	Minimum number of characters to send
+ *		char pad		' ' to right align, '0' for leading zeros
  *
- * Please not that this function blocks on lock. However, having a TX
- * buffer locked here should not normally happen, as the interrupt that
- * could lock it does not return unless it is unlocked again.
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the buffer is too full. Nothing is queued then.
  ************************************************************************/
 
-extern return_code_t serial_put_char(uint8_t data)
+extern return_code_t serial_put_u32_padded(
+				uint32_t value,
+				uint8_t width,
+				char pad
+				)
 {
 
-	return_code_t retval = SERIAL_ERROR;
+	return put_decimal(value, 0, width, pad);
 
-	acquire_buffer_lock(&tx_buffer);
-	if (tx_buffer.top < TX_BUFFER_SIZE) {
-		tx_buffer.data[(tx_buffer.top)++] = data;
-		retval = SERIAL_OK;
-	}
-	release_buffer_lock(&tx_buffer);
+}
 
-	return retval;
+extern return_code_t serial_put_s32_padded(
+				int32_t value,
+				uint8_t width,
+				char pad
+				)
+{
+
+	// Negate unsigned, so INT32_MIN comes out right too
+	if (value < 0)
+		return put_decimal(0 - (uint32_t) value, 1, width, pad);
+
+	return put_decimal(value, 0, width, pad);
 
 }
 
 /************************************************************************
- * serial_send_data: Send multiple byte serial data
+ * serial_put_hex(8|16|32): Send a number as 2, 4 or 8 hex digits
  *
  * Parameters:
- *		char *data	The data to be sent
+ *		value			The number
  *
  * Returns:
- *		Number of bytes sent out. This could be less than length, as the
- *		buffer might be full or some other error might have occured
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the buffer is too full. Nothing is queued then.
  ************************************************************************/
 
-extern uint16_t serial_send_data(char *data)
+extern return_code_t serial_put_hex8(uint8_t value)
 {
 
-	uint16_t data_length = strlen(data);
-	uint16_t i;
+	return put_hex(value, 2);
 
+}
 
-	for (i = 0; i < data_length; i++) {
+extern return_code_t serial_put_hex16(uint16_t value)
+{
 
-		if (serial_put_char(data[i]) == SERIAL_ERROR) 
-			break;
+	return put_hex(value, 4);
 
-	}
+}
+
+extern return_code_t serial_put_hex32(uint32_t value)
+{
 
-	return i;
+	return put_hex(value, 8);
 
 }
 
-#ifndef TX_ONLY
-static void wait_buffer_clean(volatile struct buffer *buffer) {
+#ifdef SERIAL_STDIO
+/************************************************************************
+ * stdio binding
+ *
+ * A write only stream, so printf and friends can send through the TX 
+ * buffer. Waits for room like serial_write_blocking.
+ ************************************************************************/
+
+static int stdio_put(char data, FILE *stream)
+{
+
+	serial_write_blocking((const uint8_t *) &data, 1);
+
+	return 0;
+
+}
+
+static FILE serial_stream = FDEV_SETUP_STREAM(stdio_put, NULL, _FDEV_SETUP_WRITE);
+
+/************************************************************************
+ * serial_stdio_init: send stdout and stderr through the serial port
+ *
+ * Parameters: none
+ *
+ * Returns: nothing
+ ************************************************************************/
+
+extern void serial_stdio_init()
+{
 
-	// Spin on dirty buffer.
-	while(buffer->dirty);
+	stdout = &serial_stream;
+	stderr = &serial_stream;
 
 }
+#endif
 
+#ifndef TX_ONLY
 /************************************************************************
  * serial_data_pending: Check whether any data has been received
  *
@@ -678,14 +2042,7 @@ static void wait_buffer_clean(volatile struct buffer *buffer) {
 extern uint16_t serial_data_pending()
 {
 
-	uint16_t retval = 0;
-
-	if (rx_buffer.top) {
-		wait_buffer_clean(&rx_buffer);
-		retval = rx_buffer.top;
-	}
-
-	return retval;
+	return (rx_buffer.head - rx_buffer.tail) & RX_BUFFER_MASK;
 
 }
 
@@ -696,42 +2053,257 @@ extern uint16_t serial_data_pending()
  * Parameters: none
  *
  * Returns: 
- *		uint8_t	data	The data retrieved from the buffer
+ *		uint8_t	data	The data retrieved from the buffer, 0 if there
+ *						was none
  ************************************************************************/
 
 extern uint8_t serial_get_char()
 {
 
 	uint8_t my_data;
+	uint8_t tail = rx_buffer.tail;
 
-	wait_buffer_clean(&rx_buffer);
+	if (buffer_empty(&rx_buffer))
+		return 0;
 
-	my_data = rx_buffer.data[0];  	// FIFO: always read from the front
-	rx_buffer.dirty = 1;		// Signal bottom handler to shift data
+	my_data = rx_buffer.data[tail];
+	rx_buffer.tail = (tail + 1) & RX_BUFFER_MASK;
 
 	return my_data;
 
 }
 
+/************************************************************************
+ * serial_read: get a block of data from the receive buffer
+ *
+ * Parameters:
+ *		uint8_t *data		Where to put the data
+ *		uint16_t length		Maximum number of bytes to get
+ *
+ * Returns:
+ *		Number of bytes copied, 0 if nothing was received. Never blocks.
+ *
+ * Like serial_write, the data is taken in one pass and released with a
+ * single tail update.
+ ************************************************************************/
+
+extern uint16_t serial_read(uint8_t *data, uint16_t length)
+{
+
+	volatile uint8_t *buffer = rx_buffer.data;
+	uint8_t tail = rx_buffer.tail;
+	uint8_t pending = (rx_buffer.head - tail) & RX_BUFFER_MASK;
+	uint16_t read;
+
+	if (length > pending)
+		length = pending;
+	read = length;
+
+	while (length--) {
+		*data++ = buffer[tail];
+		tail = (tail + 1) & RX_BUFFER_MASK;
+	}
+
+	rx_buffer.tail = tail;	// Release only after the data is out
+
+	return read;
+
+}
+
+/************************************************************************
+ * serial_read_line: get a complete line from the receive buffer
+ *
+ * Parameters:
+ *		char *line			Where to put the line
+ *		uint16_t size		Size of line, including the terminating 0
+ *
+ * Returns:
+ *		Length of the line, 0 if no complete line has been received
+ *		yet. Never blocks.
+ *
+ * A line ends in CR, LF or CR LF. The terminator is consumed but not
+ * copied, and empty lines are skipped. A partial line stays in the
+ * buffer until the rest of it comes in, unless it already fills line
+ * or the receive buffer: then that much is returned as a line, so a 
+ * long line can never stall the receiver.
+ ************************************************************************/
+
+extern uint16_t serial_read_line(char *line, uint16_t size)
+{
+
+	volatile uint8_t *buffer = rx_buffer.data;
+	uint8_t head = rx_buffer.head;
+	uint8_t tail = rx_buffer.tail;
+	uint8_t pending;
+	uint16_t length;
+	uint16_t i;
+	uint8_t data;
+
+	if (size < 2)
+		return 0;
+
+	// Skip what is left of earlier lines' terminators
+	while (tail != head && (buffer[tail] == '\r' || buffer[tail] == '\n'))
+		tail = (tail + 1) & RX_BUFFER_MASK;
+	rx_buffer.tail = tail;
+
+	pending = (head - tail) & RX_BUFFER_MASK;
+
+	for (length = 0; length < pending && length < size - 1; length++) {
+		data = buffer[(tail + length) & RX_BUFFER_MASK];
+		if (data == '\r' || data == '\n')
+			break;
+	}
+
+	// No terminator yet, and room for more on both sides: wait
+	if (length == pending && length < size - 1 && 
+		pending < RX_BUFFER_SIZE - 1)
+		return 0;
+
+	for (i = 0; i < length; i++) {
+		line[i] = buffer[tail];
+		tail = (tail + 1) & RX_BUFFER_MASK;
+	}
+	line[length] = 0;
+
+	rx_buffer.tail = tail;	// The terminator goes on the next call
+
+	return length;
+
+}
+
+/************************************************************************
+ * serial_rx_overflows / serial_rx_framing_errors: RX error counters
+ *
+ * Parameters: none
+ *
+ * Returns: 
+ *		uint16_t count	Bytes dropped because the receive buffer was
+ *						full / frames without a valid stop bit, since
+ *						initialisation. Wraps around.
+ ************************************************************************/
+
+extern uint16_t serial_rx_overflows()
+{
+
+	uint16_t count;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = rx_overflows;
+	}
+
+	return count;
+
+}
+
+extern uint16_t serial_rx_framing_errors()
+{
+
+	uint16_t count;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = rx_framing_errors;
+	}
+
+	return count;
+
+}
+
 /************************************************************************
  * (en|dis)able_receive: start or stop listening for incoming data
  *
  * Parameters: none
  *
  * Returns: nothing
+ *
+ * Only the RX pin is taken out of PCMSK, the pin change interrupt 
+ * itself stays enabled for other users. A frame that is being received
+ * when receive is disabled is still completed.
  ************************************************************************/
 
 extern void serial_enable_receive()
 {
 
-	enable_rx_interrupt();
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		rx_enabled = 1;
+		if (!rx_active)
+			PCMSK |= (1 << RX_PIN); // Bit positions in PCMSK match pin numbers
+	}
 
 }
 
 extern void serial_disable_receive()
 {
 
-	disable_rx_interrupt();
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		rx_enabled = 0;
+		PCMSK &= ~(1 << RX_PIN);
+	}
+
+}
+
+#ifdef SERIAL_AUTOBAUD
+/************************************************************************
+ * serial_autobaud: detect the baud rate from the next sync byte
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		SERIAL_OK if detection has started
+ *		SERIAL_ERROR if a byte is being sent or received
+ *
+ * Timer1 runs free while measuring, and its compare match interrupt 
+ * is off, so nothing goes out at a rate that is about to change.
+ ************************************************************************/
+
+extern return_code_t serial_autobaud()
+{
+
+	return_code_t result = SERIAL_ERROR;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+
+		if (tx_idle && !rx_active) {
+
+			TIMSK &= ~(1 << OCIE1A);
+			TCCR1 = AUTOBAUD_PRESCALER_BITS;	// No CTC: counts to 255
+			TCNT1 = 0;
+			TIFR = (1 << TOV1);
+			TIMSK |= (1 << TOIE1);
+
+			autobaud_overflows = 0;
+			autobaud_edges = 0;
+			baud_rate = 0;
+			result = SERIAL_OK;
+
+		}
+
+	}
+
+	return result;
+
+}
+
+/************************************************************************
+ * serial_baud_rate: the rate in use
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint32_t baud	0 while autobaud is measuring
+ ************************************************************************/
+
+extern uint32_t serial_baud_rate()
+{
+
+	uint32_t baud;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		baud = baud_rate;
+	}
+
+	return baud;
 
 }
 #endif
+#endif
@@ -4,25 +4,193 @@
  * AVR software serial library
  ************************************************************************/
 
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include <avr/pgmspace.h>
+
 #define SERIAL_SPEED_2400	0
 #define SERIAL_SPEED_9600	1
 #define SERIAL_SPEED_19200	2
 #define SERIAL_SPEED_38400	3
 #define SERIAL_SPEED_57600	4
 #define SERIAL_SPEED_115200	5
+#define SERIAL_SPEED_230400	6
+#define SERIAL_SPEED_250000	7
 
-#define	TX_PORT						PORTB
-#define TX_PIN						PB4
+/************************************************************************
+ * Settings
+ *
+ * Each of these can also be set on the compiler command line, e.g. 
+ * -DTX_BUFFER_SIZE=16. Define SERIAL_FULL_DUPLEX there, or remove 
+ * TX_ONLY here, for RX.
+ ************************************************************************/
+
+#ifndef SERIAL_SPEED
 #define SERIAL_SPEED				SERIAL_SPEED_9600
-#define RX_BUFFER_SIZE				64			// In bytes
-#define TX_BUFFER_SIZE				64			// In bytes
+#endif
+#ifndef RX_BUFFER_SIZE
+#define RX_BUFFER_SIZE				64			// In bytes, power of two
+#endif
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE				64			// In bytes, power of two
+#endif
+#ifndef TX_DESCRIPTOR_COUNT
+#define TX_DESCRIPTOR_COUNT			4			// Queued flash strings, power of two
+#endif
+#ifndef SERIAL_FULL_DUPLEX
 #define TX_ONLY
+#endif
+
+/************************************************************************
+ * Baud rate generation
+ *
+ * Timer prescaler and compare values are worked out at compile time 
+ * from F_CPU and SERIAL_SPEED (or SERIAL_BAUD, if defined, for any other
+ * rate). The build fails if the rate comes out more than 
+ * SERIAL_MAX_BAUD_ERROR percent off.
+ * Define SERIAL_TIMER1_PLL to clock Timer1 from the 64 MHz PLL, for 
+ * finer steps at high rates. The PLL needs at least 2.7 V.
+ * At 8 MHz, 230400 and 250000 baud need SERIAL_TX_USI: the Timer1 
+ * engine takes an interrupt per bit.
+ ************************************************************************/
+
+#define SERIAL_MAX_BAUD_ERROR		2			// Percent
+//#define SERIAL_TIMER1_PLL
+
+/************************************************************************
+ * stdio
+ *
+ * Define SERIAL_STDIO to get serial_stdio_init, which points stdout 
+ * and stderr at the serial port for code that insists on printf. The
+ * serial_put_ number functions are much smaller and faster.
+ ************************************************************************/
+
+//#define SERIAL_STDIO
+
+/************************************************************************
+ * TX engine
+ *
+ * By default every bit is sent from the Timer1 interrupt. Define 
+ * SERIAL_TX_USI to have the USI shift the bits out instead, clocked by 
+ * Timer0 at the bit rate, with one interrupt per half byte. This makes
+ * 115200 baud usable at 8 MHz. It needs TX_ONLY, sends on PB1 (USI DO)
+ * and takes Timer0, so build the debounce library with DEBOUNCE_TIMER1.
+ ************************************************************************/
+
+//#define SERIAL_TX_USI
+
+/************************************************************************
+ * System tick
+ *
+ * Define SERIAL_SYSTEM_TICK to have the Timer1 engine provide a 10ms
+ * tick as well, so that one timer and one interrupt serve both, in a 
+ * fixed order, and Timer0 is free for PWM. Timer1 then never stops, and
+ * every SERIAL_BAUD / 100 bit periods its interrupt calls 
+ * SERIAL_TICK_HANDLER, once the TX bits for that period are out and
+ * the next frames are loaded. Build the debounce library with 
+ * DEBOUNCE_SERIAL_TICK for debounce_tick. The tick is as accurate as 
+ * the baud rate. The handler runs with interrupts enabled, so it delays
+ * neither RX nor TX bits, and is never called again before it returns.
+ * A handler that takes longer than a bit period delays the next TX
+ * frame, though. An idle line now costs a short interrupt per bit. Not
+ * with SERIAL_TX_USI or SERIAL_AUTOBAUD.
+ ************************************************************************/
+
+//#define SERIAL_SYSTEM_TICK
+#ifndef SERIAL_TICK_HANDLER
+#define SERIAL_TICK_HANDLER			debounce_tick
+#endif
+
+#define	TX_PORT						PORTB
+#ifdef SERIAL_TX_USI
+#define TX_PIN						PB1			// USI DO, fixed
+#else
+#define TX_PIN						PB4
+#endif
+
+/************************************************************************
+ * TX channels
+ *
+ * The Timer1 engine can send on up to 4 PORTB pins at SERIAL_SPEED, from
+ * the same interrupt: the bits of all channels go out with a single 
+ * port write per bit period. TX_PIN is channel 0, set 
+ * SERIAL_TX_CHANNELS and the pins of the others below. Every channel has
+ * its own TX buffer and descriptors. serial_select_channel picks the 
+ * channel the TX functions work on.
+ * With more than one channel the interrupt rewrites PORTB as a whole:
+ * elsewhere, only change PORTB with single bit operations on constant
+ * pins (sbi / cbi) or with interrupts disabled. With one channel it
+ * only sets or clears TX_PIN.
+ ************************************************************************/
+
+#ifndef SERIAL_TX_CHANNELS
+#define SERIAL_TX_CHANNELS			1
+#endif
+#define TX_PIN_1					PB0
+#define TX_PIN_2					PB2
+#define TX_PIN_3					PB1
+
+/************************************************************************
+ * RX
+ *
+ * Without TX_ONLY, incoming start bits are caught by the pin change 
+ * interrupt, and every bit is then sampled three times around its 
+ * centre from the Timer1 Compare Match B interrupt, alongside TX on 
+ * Compare Match A. Received bytes are only late if another interrupt
+ * holds off Timer1 for more than about a third of a bit. Compare Match
+ * A loads its next frames, producers included, with interrupts enabled,
+ * so it is only other interrupts that need to be short at 38400 baud.
+ *
+ * There is only one pin change interrupt vector. If something else, 
+ * e.g. the debounce library's encoders, needs it as well, define 
+ * SERIAL_SHARED_PCINT and call serial_pin_change from your own 
+ * ISR(PCINT0_vect).
+ ************************************************************************/
+
+#define RX_PORT						PINB		// Input register
+#define RX_PIN						PB3
+
+//#define SERIAL_SHARED_PCINT
+
+/************************************************************************
+ * Autobaud
+ *
+ * Define SERIAL_AUTOBAUD (needs RX, so not TX_ONLY) to get 
+ * serial_autobaud, which makes the RX engine measure the next sync byte
+ * 0x55 ('U') on the line instead of receiving it. Its start bit and 
+ * alternating data bits give five falling edges eight bit periods apart,
+ * timed with Timer1 running free. The nearest standard rate from 2400 to 
+ * 115200 that the Timer1 engine can keep up with at this F_CPU is then 
+ * used for RX and TX alike. The sync byte is not stored. SERIAL_SPEED is 
+ * the rate until then. Have the host send "UUUU..." until the device 
+ * answers; sync bytes after the first arrive as ordinary 'U's.
+ ************************************************************************/
+
+//#define SERIAL_AUTOBAUD
+
+/************************************************************************
+ * Events
+ *
+ * Define SERIAL_EVENTS to let an interrupt send on channel 0 without the
+ * main loop: serial_set_event_source registers a producer that the TX
+ * interrupt polls whenever channel 0 has nothing else queued, and the 
+ * interrupt that produces an event calls serial_event_ready. Each frame
+ * goes out whole, after whatever data was queued before it. telemetry.c
+ * uses this to forward button presses, see TELEMETRY_FORWARD.
+ ************************************************************************/
+
+//#define SERIAL_EVENTS
 
 typedef enum {
 	SERIAL_ERROR,
 	SERIAL_OK,	
 } return_code_t ;
 
+// Producer callback for serial_send_stream. Returns the next byte to
+// send (0 - 255), or a negative value when there is no more data.
+typedef int16_t (*serial_producer_t)(void *context);
+
 /************************************************************************
  * serial_initialise: set up connection
  * 
@@ -34,9 +202,10 @@ typedef enum {
  *
  * This function:
  *  - Mallocs RX & TX buffers
- *  - Starts the timer to provide the 'clock'
+ *  - Sets up the timer to provide the 'clock'
  *  - Sets up the I/O ports
- *  - Sets up the frame receive interrupt
+ *  - Sets up the frame receive interrupt. Call serial_enable_receive
+ *    to start listening.
  * Possible errors are:
  *  - Not enough memory for buffers
  *  - Timer already running, so UART connection already started
@@ -45,6 +214,23 @@ typedef enum {
  
 extern return_code_t serial_initialise();
 
+/************************************************************************
+ * serial_select_channel: pick the TX channel to send on
+ *
+ * Parameters:
+ *		uint8_t channel		0 - SERIAL_TX_CHANNELS - 1
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if there is no such channel
+ *
+ * All TX functions (serial_put_char, serial_write, serial_send_P, the
+ * number formatters...) work on the selected channel, 0 by default. 
+ * Select from the main loop only.
+ ************************************************************************/
+
+extern return_code_t serial_select_channel(uint8_t channel);
+
 /************************************************************************
  * serial_put_char: send a single byte
  *
@@ -71,6 +257,199 @@ extern return_code_t serial_put_char(uint8_t data);
 
 extern uint16_t serial_send_data(char *data);
 
+/************************************************************************
+ * serial_write: Send a block of binary data
+ *
+ * Parameters:
+ *		const uint8_t *data	The data to be sent, may contain 0 bytes
+ *		uint16_t length		Number of bytes to send
+ *
+ * Returns:
+ *		Number of bytes queued. This is less than length if the buffer
+ *		did not have room for all of it. Nothing is dropped silently:
+ *		the caller can send the rest later.
+ ************************************************************************/
+
+extern uint16_t serial_write(const uint8_t *data, uint16_t length);
+
+/************************************************************************
+ * serial_tx_room: Free space in the TX buffer
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		Number of bytes serial_write will take right now. Use it to
+ *		queue a record whole or not at all.
+ ************************************************************************/
+
+extern uint8_t serial_tx_room();
+
+/************************************************************************
+ * serial_send_P: Send a string from flash without copying it
+ *
+ * Parameters:
+ *		PGM_P data	The string to be sent, e.g. PSTR("Hello")
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if TX_DESCRIPTOR_COUNT - 1 strings are already 
+ *		waiting to be sent
+ *
+ * The string is read from flash by the interrupt as it is sent, so it
+ * uses no SRAM and is not limited by TX_BUFFER_SIZE. It goes out after
+ * anything queued before it and before anything queued after it.
+ ************************************************************************/
+
+extern return_code_t serial_send_P(PGM_P data);
+
+/************************************************************************
+ * serial_send_stream: Send data generated on demand
+ *
+ * Parameters:
+ *		serial_producer_t producer	Called for every byte to send
+ *		void *context				Passed to producer as is, e.g. a
+ *									cursor into the data to dump
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if TX_DESCRIPTOR_COUNT - 1 flash strings and 
+ *		streams are already waiting to be sent
+ *
+ * When everything queued before it has gone out, producer is called for
+ * each next byte, until it returns a negative value. This way large 
+ * outputs (logs, tables) are generated lazily, without buffering.
+ *
+ * producer is called from the Timer1 interrupt, once per byte, so it 
+ * must be short and must not call other serial functions. On Timer1,
+ * interrupts are enabled meanwhile. Data queued after the stream waits
+ * until the stream ends.
+ ************************************************************************/
+
+extern return_code_t serial_send_stream(
+				serial_producer_t producer,
+				void *context
+				);
+
+#ifdef SERIAL_EVENTS
+/************************************************************************
+ * serial_set_event_source: Send frames generated by an interrupt
+ *
+ * Parameters:
+ *		serial_producer_t producer	Called for every byte to send, NULL
+ *									to remove the event source
+ *		void *context				Passed to producer as is
+ *
+ * Whenever channel 0 has sent everything queued, producer is called for
+ * the next byte. It returns a negative value when it has no frame, and
+ * once at the end of every frame: a frame is never split, and data
+ * queued meanwhile goes out before the next one. producer is called
+ * from the Timer1 interrupt (the USI interrupt with SERIAL_TX_USI, and
+ * from serial_event_ready), with the same rules as for
+ * serial_send_stream.
+ ************************************************************************/
+
+extern void serial_set_event_source(serial_producer_t producer, void *context);
+
+/************************************************************************
+ * serial_event_ready: Tell the transmitter the event source has a frame
+ *
+ * Call after publishing the frame. Safe from an interrupt.
+ ************************************************************************/
+
+extern void serial_event_ready(void);
+#endif
+
+/************************************************************************
+ * serial_write_blocking: Send a block of binary data, waiting for room
+ *
+ * Parameters:
+ *		const uint8_t *data	The data to be sent, may contain 0 bytes
+ *		uint16_t length		Number of bytes to send
+ *
+ * Returns: nothing. All data has been queued when this returns.
+ *
+ * Sleeps in idle mode while the buffer is full. Interrupts must be
+ * enabled. Not to be called from an interrupt.
+ ************************************************************************/
+
+extern void serial_write_blocking(const uint8_t *data, uint16_t length);
+
+/************************************************************************
+ * serial_put_(u|s)(8|16|32): Send a number in decimal
+ *
+ * Parameters:
+ *		value			The number
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the buffer is too full. Nothing is queued then.
+ *
+ * The digits go straight into the TX buffer: no sprintf, no temporary
+ * string and no division.
+ ************************************************************************/
+
+extern return_code_t serial_put_u8(uint8_t value);
+extern return_code_t serial_put_u16(uint16_t value);
+extern return_code_t serial_put_u32(uint32_t value);
+extern return_code_t serial_put_s8(int8_t value);
+extern return_code_t serial_put_s16(int16_t value);
+extern return_code_t serial_put_s32(int32_t value);
+
+/************************************************************************
+ * serial_put_(u|s)32_padded: Send a number in decimal, in a fixed width
+ *
+ * Parameters:
+ *		value			The number
+ *		uint8_t width	Minimum number of characters to send
+ *		char pad		' ' to right align, '0' for leading zeros
+ *						(after the sign)
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the buffer is too full. Nothing is queued then.
+ ************************************************************************/
+
+extern return_code_t serial_put_u32_padded(
+				uint32_t value,
+				uint8_t width,
+				char pad
+				);
+extern return_code_t serial_put_s32_padded(
+				int32_t value,
+				uint8_t width,
+				char pad
+				);
+
+/************************************************************************
+ * serial_put_hex(8|16|32): Send a number as 2, 4 or 8 hex digits
+ *
+ * Parameters:
+ *		value			The number
+ *
+ * Returns:
+ *		SERIAL_OK on success
+ *		SERIAL_ERROR if the buffer is too full. Nothing is queued then.
+ ************************************************************************/
+
+extern return_code_t serial_put_hex8(uint8_t value);
+extern return_code_t serial_put_hex16(uint16_t value);
+extern return_code_t serial_put_hex32(uint32_t value);
+
+#ifdef SERIAL_STDIO
+/************************************************************************
+ * serial_stdio_init: send stdout and stderr through the serial port
+ *
+ * Parameters: none
+ *
+ * Returns: nothing
+ *
+ * Output waits for room in the buffer, like serial_write_blocking, so
+ * no printf from interrupts.
+ ************************************************************************/
+
+extern void serial_stdio_init();
+#endif
+
 #ifndef TX_ONLY
 /************************************************************************
  * serial_data_pending: Check whether any data has been received
@@ -89,11 +468,72 @@ extern uint16_t serial_data_pending();
  * Parameters: none
  *
  * Returns: 
- *		uint8_t	data	The data retrieved from the buffer
+ *		uint8_t	data	The data retrieved from the buffer, 0 if there
+ *						was none
  ************************************************************************/
 
 extern uint8_t serial_get_char();
 
+/************************************************************************
+ * serial_read: get a block of data from the receive buffer
+ *
+ * Parameters:
+ *		uint8_t *data		Where to put the data
+ *		uint16_t length		Maximum number of bytes to get
+ *
+ * Returns:
+ *		Number of bytes copied, 0 if nothing was received. Never blocks.
+ ************************************************************************/
+
+extern uint16_t serial_read(uint8_t *data, uint16_t length);
+
+/************************************************************************
+ * serial_read_line: get a complete line from the receive buffer
+ *
+ * Parameters:
+ *		char *line			Where to put the line
+ *		uint16_t size		Size of line, including the terminating 0
+ *
+ * Returns:
+ *		Length of the line, 0 if no complete line has been received
+ *		yet. Never blocks.
+ *
+ * A line ends in CR, LF or CR LF, which is not copied. Empty lines are 
+ * skipped. A line that does not fit in line (or in the receive buffer)
+ * is returned in pieces.
+ ************************************************************************/
+
+extern uint16_t serial_read_line(char *line, uint16_t size);
+
+/************************************************************************
+ * serial_rx_overflows / serial_rx_framing_errors: RX error counters
+ *
+ * Parameters: none
+ *
+ * Returns: 
+ *		uint16_t count	Bytes dropped because the receive buffer was
+ *						full / frames without a valid stop bit, since
+ *						initialisation. Wraps around.
+ ************************************************************************/
+
+extern uint16_t serial_rx_overflows();
+extern uint16_t serial_rx_framing_errors();
+
+#ifdef SERIAL_SHARED_PCINT
+/************************************************************************
+ * serial_pin_change: RX start bit detection
+ *
+ * Parameters: none
+ *
+ * Returns: nothing
+ *
+ * Only with SERIAL_SHARED_PCINT. Call this from ISR(PCINT0_vect), first
+ * thing: the start bit is timed from the moment it runs.
+ ************************************************************************/
+
+extern void serial_pin_change(void);
+#endif
+
 /************************************************************************
  * (en|dis)able_receive: start or stop listening for incoming data
  *
@@ -104,4 +544,36 @@ extern uint8_t serial_get_char();
 
 extern void serial_enable_receive();
 extern void serial_disable_receive();
+
+#ifdef SERIAL_AUTOBAUD
+/************************************************************************
+ * serial_autobaud: detect the baud rate from the next sync byte
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		SERIAL_OK if detection has started
+ *		SERIAL_ERROR if a byte is being sent or received. Try again
+ *		once serial_tx_room shows an empty buffer.
+ *
+ * Receive must be enabled. Until a rate has been detected, TX data is
+ * queued but not sent. Calling this again starts over.
+ ************************************************************************/
+
+extern return_code_t serial_autobaud();
+
+/************************************************************************
+ * serial_baud_rate: the rate in use
+ *
+ * Parameters: none
+ *
+ * Returns:
+ *		uint32_t baud	The detected or configured rate, 0 while 
+ *						serial_autobaud is still waiting for a sync byte
+ ************************************************************************/
+
+extern uint32_t serial_baud_rate();
+#endif
 #endif
+
+#endif /* SERIAL_H_ */
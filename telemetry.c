@@ -0,0 +1,519 @@
+/*
+ * telemetry.c
+ *
+ * Compact binary telemetry over libserial: COBS framed messages
+ * with a type byte and a CRC-8. See telemetry.h for the format.
+ */
+
+
+#include <avr/io.h>
+#include <stdint.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+#include "telemetry.h"
+
+// Type, payload and CRC, plus the COBS code byte and delimiter
+#define FRAME_SIZE			(1 + TELEMETRY_MAX_PAYLOAD + 1)
+#define ENCODED_SIZE		(FRAME_SIZE + 2)
+
+#ifdef TELEMETRY_FORWARD
+#if !defined(DEBOUNCE_EVENTS) || !defined(SERIAL_EVENTS)
+#error TELEMETRY_FORWARD needs DEBOUNCE_EVENTS and SERIAL_EVENTS
+#endif
+#ifndef DEBOUNCE_EVENT_HANDLER
+#error TELEMETRY_FORWARD needs DEBOUNCE_EVENT_HANDLER telemetry_button_event
+#endif
+#if TELEMETRY_FORWARD_QUEUE & (TELEMETRY_FORWARD_QUEUE - 1)
+#error TELEMETRY_FORWARD_QUEUE must be a power of two
+#endif
+#define FORWARD_MASK		(TELEMETRY_FORWARD_QUEUE - 1)
+// Button and tick messages both have 4 bytes of payload. The id, tick
+// bytes and CRC may well be 0, but COBS adds exactly one byte to any
+// frame under 254 bytes, so with the delimiter it is always 8 bytes
+#define FORWARD_PAYLOAD		4
+#define FORWARD_FRAME_SIZE	(1 + FORWARD_PAYLOAD + 1 + 2)
+#endif
+
+/*********************************************************************
+ * File global variables
+ *********************************************************************/
+
+static uint16_t dropped = 0;
+
+// High 16 bits of the tick last sent in full
+static uint16_t last_tick_high = 0;
+static uint8_t tick_sent = 0;
+
+#ifdef DEBOUNCE_TRACE
+// Tick of the next run to send
+static uint32_t trace_tick = 0;
+#endif
+
+#ifdef TELEMETRY_FORWARD
+static button_t forward_buttons[TELEMETRY_FORWARD_BUTTONS];
+static uint8_t forward_ids[TELEMETRY_FORWARD_BUTTONS];
+static uint8_t forward_count = 0;
+
+// Messages, from the debounce interrupt to the serial interrupt. Head
+// belongs to the first, tail to the second.
+struct forward_message {
+	uint8_t type;
+	uint8_t payload[FORWARD_PAYLOAD];
+};
+
+static struct forward_message forward_queue[TELEMETRY_FORWARD_QUEUE];
+static volatile uint8_t forward_head = 0;
+static volatile uint8_t forward_tail = 0;
+static volatile uint16_t forward_dropped = 0;
+
+// The message going out, encoded, serial interrupt only
+static uint8_t forward_frame[FORWARD_FRAME_SIZE];
+static uint8_t forward_index = 0;		// Next byte, 0 between frames
+
+// As last_tick_high and tick_sent, for the forwarded messages
+static uint16_t forward_tick_high = 0;
+static uint8_t forward_tick_sent = 0;
+#endif
+
+/*********************************************************************
+ * Private functions
+ *********************************************************************/
+
+/******************************************************************
+ * cobs_encode: COBS encode a frame and add the delimiter
+ *
+ * Every 0 byte is replaced by the distance to the next one, with
+ * a leading code byte for the first. Frames are far shorter than
+ * 254 bytes, so there is never a full block to split.
+ *
+ * Returns the encoded length
+ ******************************************************************/
+
+static uint8_t cobs_encode(const uint8_t *in, uint8_t length, uint8_t *out)
+{
+
+	uint8_t code_index = 0;
+	uint8_t out_index = 1;
+	uint8_t code = 1;
+
+	while (length--) {
+
+		if (*in) {
+			out[out_index++] = *in;
+			code++;
+		} else {
+			out[code_index] = code;
+			code_index = out_index++;
+			code = 1;
+		}
+		in++;
+
+	}
+
+	out[code_index] = code;
+	out[out_index++] = 0;
+
+	return out_index;
+
+}
+
+/******************************************************************
+ * encode_frame: build a frame and COBS encode it
+ *
+ * Returns the encoded length, at most ENCODED_SIZE
+ ******************************************************************/
+
+static uint8_t encode_frame(
+				uint8_t type,
+				const uint8_t *payload,
+				uint8_t length,
+				uint8_t *encoded
+				)
+{
+
+	uint8_t frame[FRAME_SIZE];
+	uint8_t crc;
+	uint8_t i;
+
+	frame[0] = type;
+	crc = _crc8_ccitt_update(0, type);
+	for (i = 0; i < length; i++) {
+		frame[i + 1] = payload[i];
+		crc = _crc8_ccitt_update(crc, payload[i]);
+	}
+	frame[length + 1] = crc;
+
+	return cobs_encode(frame, length + 2, encoded);
+
+}
+
+/******************************************************************
+ * put_u16 / put_u32: store a little endian field
+ ******************************************************************/
+
+static uint8_t *put_u16(uint8_t *p, uint16_t value)
+{
+
+	*p++ = value;
+	*p++ = value >> 8;
+
+	return p;
+
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t value)
+{
+
+	p = put_u16(p, value);
+
+	return put_u16(p, value >> 16);
+
+}
+
+#ifdef TELEMETRY_FORWARD
+/******************************************************************
+ * forward_producer: libserial event source for forwarded presses
+ *
+ * Called from the serial interrupt. Returns the next byte of the
+ * frame going out, and -1 after its last byte or when the queue 
+ * is empty. The message at the tail is encoded when its frame 
+ * starts, which the Timer1 engine does after the TX bits, with 
+ * interrupts enabled, and its place is freed right away.
+ ******************************************************************/
+
+static int16_t forward_producer(void *context)
+{
+
+	uint8_t tail = forward_tail;
+
+	(void) context;
+
+	if (forward_index == FORWARD_FRAME_SIZE) {
+		forward_index = 0;
+		return -1;
+	}
+
+	if (forward_index == 0) {
+
+		if (tail == forward_head)
+			return -1;
+
+		encode_frame(forward_queue[tail].type, forward_queue[tail].payload,
+				FORWARD_PAYLOAD, forward_frame);
+		forward_tail = (tail + 1) & FORWARD_MASK;
+
+	}
+
+	return forward_frame[forward_index++];
+
+}
+#endif
+
+/*********************************************************************
+ * Public functions
+ *********************************************************************/
+
+/*********************************************************************
+ * telemetry_send: send a message
+ *
+ * Parameters:
+ *		uint8_t type
+ *		const uint8_t *payload
+ *		uint8_t length
+ * Returns:
+ *		SERIAL_OK if the frame was queued, SERIAL_ERROR if not
+ *
+ * The frame is built and encoded on the stack, then queued with a
+ * single serial_write once there is room for all of it, so a
+ * frame is never cut short.
+ *********************************************************************/
+
+extern return_code_t telemetry_send(
+				uint8_t type,
+				const uint8_t *payload,
+				uint8_t length
+				)
+{
+
+	uint8_t encoded[ENCODED_SIZE];
+
+	if (length > TELEMETRY_MAX_PAYLOAD)
+		return SERIAL_ERROR;
+
+	length = encode_frame(type, payload, length, encoded);
+
+	if (serial_tx_room() < length) {
+		dropped++;
+		return SERIAL_ERROR;
+	}
+
+	serial_write(encoded, length);
+
+	return SERIAL_OK;
+
+}
+
+/*********************************************************************
+ * telemetry_button: report a button press
+ *
+ * Parameters:
+ *		uint8_t id
+ *		button_press_t press
+ * Returns:
+ *		SERIAL_OK if the frame was queued, SERIAL_ERROR if not
+ *********************************************************************/
+
+extern return_code_t telemetry_button(uint8_t id, button_press_t press)
+{
+
+	uint8_t payload[4];
+	uint32_t ticks = debounce_ticks();
+
+	// Let the host know the high bits first if they moved on
+	if (!tick_sent || (uint16_t) (ticks >> 16) != last_tick_high)
+		telemetry_tick();
+
+	payload[0] = id;
+	payload[1] = press;
+	put_u16(&payload[2], ticks);
+
+	return telemetry_send(TELEMETRY_BUTTON, payload, sizeof(payload));
+
+}
+
+/*********************************************************************
+ * telemetry_tick: send the full current tick
+ *
+ * Returns:
+ *		SERIAL_OK if the frame was queued, SERIAL_ERROR if not
+ *********************************************************************/
+
+extern return_code_t telemetry_tick(void)
+{
+
+	uint8_t payload[4];
+	uint32_t ticks = debounce_ticks();
+
+	put_u32(payload, ticks);
+
+	if (telemetry_send(TELEMETRY_TICK, payload, sizeof(payload)) != SERIAL_OK)
+		return SERIAL_ERROR;
+
+	last_tick_high = ticks >> 16;
+	tick_sent = 1;
+
+	return SERIAL_OK;
+
+}
+
+#ifdef DEBOUNCE_DIAGNOSTICS
+/*********************************************************************
+ * telemetry_diagnostics: send a button's debounce statistics
+ *
+ * Parameters:
+ *		uint8_t id
+ *		button_t button
+ * Returns:
+ *		SERIAL_OK if the frame was queued, SERIAL_ERROR if not
+ *********************************************************************/
+
+extern return_code_t telemetry_diagnostics(uint8_t id, button_t button)
+{
+
+	uint8_t payload[10];
+	uint8_t *p = payload;
+	debounce_stats_t stats;
+
+	debounce_diagnostics(button, &stats);
+
+	*p++ = id;
+	p = put_u16(p, stats.glitches);
+	p = put_u16(p, stats.short_presses);
+	p = put_u16(p, stats.long_presses);
+	p = put_u16(p, stats.dropped);
+	*p++ = stats.max_bounce;
+
+	return telemetry_send(TELEMETRY_DIAGNOSTICS, payload, sizeof(payload));
+
+}
+#endif
+
+#ifdef DEBOUNCE_TRACE
+/*********************************************************************
+ * telemetry_trace_start: start a trace capture for telemetry_trace
+ *********************************************************************/
+
+extern void telemetry_trace_start(void)
+{
+
+	trace_tick = debounce_trace_start();
+
+}
+
+/*********************************************************************
+ * telemetry_trace: send the captured runs
+ *
+ * Returns:
+ *		SERIAL_OK if all runs captured so far have been queued
+ *		SERIAL_ERROR if the TX buffer filled up first
+ *
+ * Runs are only taken out of the capture once there is room for a
+ * full frame, so none are lost here.
+ *********************************************************************/
+
+extern return_code_t telemetry_trace(void)
+{
+
+	uint8_t payload[5 + 3 * 2];
+	uint8_t *p;
+	uint8_t runs;
+	uint16_t length;
+	debounce_trace_t entry;
+
+	while (serial_tx_room() >= ENCODED_SIZE) {
+
+		p = &payload[5];
+		length = 0;
+		for (runs = 0; runs < 3 && debounce_trace_read(&entry); runs++) {
+			*p++ = entry.pins;
+			*p++ = entry.length;
+			length += entry.length;
+		}
+
+		if (runs == 0)
+			return SERIAL_OK;
+
+		put_u32(payload, trace_tick);
+		payload[4] = debounce_trace_mask();
+		telemetry_send(TELEMETRY_TRACE, payload, p - payload);
+		trace_tick += length;
+
+	}
+
+	return SERIAL_ERROR;
+
+}
+#endif
+
+#ifdef TELEMETRY_FORWARD
+/*********************************************************************
+ * telemetry_forward: send a button's presses from the interrupt
+ *
+ * Parameters:
+ *		button_t button
+ *		uint8_t id
+ * Returns:
+ *		SERIAL_OK if the button is forwarded from now on
+ *		SERIAL_ERROR if the table is full
+ *
+ * The first button also makes the queue libserial's event source.
+ *********************************************************************/
+
+extern return_code_t telemetry_forward(button_t button, uint8_t id)
+{
+
+	if (forward_count == TELEMETRY_FORWARD_BUTTONS)
+		return SERIAL_ERROR;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		forward_buttons[forward_count] = button;
+		forward_ids[forward_count] = id;
+		forward_count++;
+	}
+
+	if (forward_count == 1)
+		serial_set_event_source(forward_producer, NULL);
+
+	return SERIAL_OK;
+
+}
+
+/*********************************************************************
+ * telemetry_button_event: the DEBOUNCE_EVENT_HANDLER
+ *
+ * Parameters:
+ *		button_t button
+ *		button_press_t press
+ * Returns:
+ *		1 if the button is forwarded, so the press is taken
+ *		0 if not, it is left for button_check
+ *
+ * Runs in the debounce interrupt, so it only queues the message 
+ * and forward_producer encodes it. A tick message goes first when
+ * the high bits moved on, as in telemetry_button. If the queue has
+ * no room for all of it, the press is dropped and counted.
+ *********************************************************************/
+
+extern uint8_t telemetry_button_event(button_t button, button_press_t press)
+{
+
+	struct forward_message *message;
+	uint8_t head = forward_head;
+	uint8_t room = (forward_tail - head - 1) & FORWARD_MASK;
+	uint8_t new_high;
+	uint8_t i;
+	uint32_t ticks;
+
+	for (i = 0; i < forward_count; i++)
+		if (forward_buttons[i] == button)
+			break;
+
+	if (i == forward_count)
+		return 0;
+
+	ticks = debounce_ticks();
+	new_high = !forward_tick_sent || (uint16_t) (ticks >> 16) != forward_tick_high;
+
+	if (room < 1 + new_high) {
+		forward_dropped++;
+		return 1;
+	}
+
+	if (new_high) {
+		message = &forward_queue[head];
+		message->type = TELEMETRY_TICK;
+		put_u32(message->payload, ticks);
+		head = (head + 1) & FORWARD_MASK;
+		forward_tick_high = ticks >> 16;
+		forward_tick_sent = 1;
+	}
+
+	message = &forward_queue[head];
+	message->type = TELEMETRY_BUTTON;
+	message->payload[0] = forward_ids[i];
+	message->payload[1] = press;
+	put_u16(&message->payload[2], ticks);
+
+	// Publish only after the messages are in
+	forward_head = (head + 1) & FORWARD_MASK;
+	serial_event_ready();
+
+	return 1;
+
+}
+#endif
+
+/*********************************************************************
+ * telemetry_dropped: get the number of frames dropped
+ *
+ * Returns:
+ *		uint16_t count
+ *********************************************************************/
+
+extern uint16_t telemetry_dropped(void)
+{
+
+#ifdef TELEMETRY_FORWARD
+	uint16_t count;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = dropped + forward_dropped;
+	}
+
+	return count;
+#else
+	return dropped;
+#endif
+
+}
@@ -0,0 +1,213 @@
+/*
+ * telemetry.h
+ *
+ * Compact binary telemetry over libserial
+ */
+
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+
+#include <stdint.h>
+
+#include "debounce.h"
+#include "serial.h"
+
+/************************************************************
+ * Frame format
+ *
+ * Each message is sent as one frame:
+ *
+ *		type | payload | CRC-8
+ *
+ * COBS encoded, so the frame contains no 0 bytes, and
+ * followed by a single 0 byte as delimiter. A receiver can
+ * join at any point and resynchronise at the next 0.
+ * The CRC-8 (polynomial 0x07, initial value 0) covers the
+ * type and payload. Multi byte fields are little endian.
+ * COBS adds exactly one byte to frames this short, so a
+ * message takes its payload plus 4 bytes on the wire: 8 for
+ * a button message or a tick.
+ * tools/telemetry_decode.c decodes the stream on the host.
+ ************************************************************/
+
+#define TELEMETRY_MAX_PAYLOAD	12
+
+/************************************************************
+ * Forwarding
+ *
+ * Define TELEMETRY_FORWARD to have presses of chosen buttons
+ * sent as TELEMETRY_BUTTON messages straight from the 
+ * debounce interrupt, without the main loop. Needs 
+ * DEBOUNCE_EVENTS and DEBOUNCE_EVENT_HANDLER 
+ * telemetry_button_event in debounce.h, and SERIAL_EVENTS
+ * in serial.h. The debounce interrupt queues the press, 
+ * and the serial interrupt encodes and sends it as soon as
+ * channel 0 is free. A press
+ * reaches the host one frame time (8 bytes) after it is
+ * classified, plus whatever the main loop queued before it.
+ * Up to TELEMETRY_FORWARD_BUTTONS buttons, and 
+ * TELEMETRY_FORWARD_QUEUE - 1 frames waiting (a power of
+ * two). A press that does not fit is counted in 
+ * telemetry_dropped.
+ *
+ * Usage:
+ *		telemetry_forward(debounce_init("PB0"), 1);
+ *		telemetry_forward(debounce_init("PB2"), 2);
+ *		sei();
+ *		while (1)
+ *			sleep_mode();
+ ************************************************************/
+
+//#define TELEMETRY_FORWARD
+#define TELEMETRY_FORWARD_BUTTONS	8
+#define TELEMETRY_FORWARD_QUEUE		4
+
+/************************************************************
+ * Message types
+ *
+ * TELEMETRY_BUTTON		id, press, tick (low 16 bits)
+ * TELEMETRY_TICK		tick (32 bits). Sent automatically
+ *						before a button message whose tick
+ *						has new high bits, so the host can
+ *						rebuild full timestamps.
+ * TELEMETRY_DIAGNOSTICS	id, glitches, short presses,
+ *						long presses, dropped presses
+ *						(16 bits each), max bounce
+ *						(8 bits)
+ * TELEMETRY_TRACE		tick of the first run (32 bits),
+ *						traced pin mask, then up to 3 runs
+ *						of PINB value and length in ticks
+ *						(8 bits each), see DEBOUNCE_TRACE
+ * TELEMETRY_USER and up are free for the application.
+ *
+ * Ticks are debounce 10ms slices, see debounce_ticks.
+ ************************************************************/
+
+typedef enum {
+	TELEMETRY_BUTTON = 1,
+	TELEMETRY_TICK = 2,
+	TELEMETRY_DIAGNOSTICS = 3,
+	TELEMETRY_TRACE = 4,
+	TELEMETRY_USER = 0x80,
+} telemetry_type_t;
+
+/*********************************************************************
+ * telemetry_send: send a message
+ *
+ * Parameters:
+ *		uint8_t type
+ *			Message type
+ *		const uint8_t *payload
+ *		uint8_t length
+ *			Message payload, at most TELEMETRY_MAX_PAYLOAD bytes
+ * Returns:
+ *		SERIAL_OK if the frame was queued
+ *		SERIAL_ERROR if there was no room for all of it. Nothing
+ *		is sent then, and the frame is counted as dropped.
+ *
+ * Not to be called from an interrupt.
+ *********************************************************************/
+extern return_code_t telemetry_send(uint8_t, const uint8_t *, uint8_t);
+
+/*********************************************************************
+ * telemetry_button: report a button press
+ *
+ * Parameters:
+ *		uint8_t id
+ *			Application chosen button number
+ *		button_press_t press
+ *			As returned by button_check
+ * Returns:
+ *		SERIAL_OK if the frame was queued
+ *		SERIAL_ERROR if it was dropped
+ *********************************************************************/
+extern return_code_t telemetry_button(uint8_t, button_press_t);
+
+/*********************************************************************
+ * telemetry_tick: send the full current tick
+ *
+ * Returns:
+ *		SERIAL_OK if the frame was queued
+ *		SERIAL_ERROR if it was dropped
+ *********************************************************************/
+extern return_code_t telemetry_tick(void);
+
+#ifdef DEBOUNCE_DIAGNOSTICS
+/*********************************************************************
+ * telemetry_diagnostics: send a button's debounce statistics
+ *
+ * Parameters:
+ *		uint8_t id
+ *			Application chosen button number
+ *		button_t button
+ * Returns:
+ *		SERIAL_OK if the frame was queued
+ *		SERIAL_ERROR if it was dropped
+ *********************************************************************/
+extern return_code_t telemetry_diagnostics(uint8_t, button_t);
+#endif
+
+#ifdef DEBOUNCE_TRACE
+/*********************************************************************
+ * telemetry_trace_start: start a trace capture for telemetry_trace
+ *
+ * Use this rather than debounce_trace_start, so the trace messages
+ * carry the right timestamps.
+ *********************************************************************/
+extern void telemetry_trace_start(void);
+
+/*********************************************************************
+ * telemetry_trace: send the captured runs
+ *
+ * Returns:
+ *		SERIAL_OK if all runs captured so far have been queued
+ *		SERIAL_ERROR if the TX buffer filled up first. The rest
+ *		stays in the capture, for the next call.
+ *
+ * Call this regularly from the main loop while capturing, and once
+ * more after debounce_trace_stop. tools/telemetry_decode turns the
+ * messages back into waveforms.
+ *********************************************************************/
+extern return_code_t telemetry_trace(void);
+#endif
+
+#ifdef TELEMETRY_FORWARD
+/*********************************************************************
+ * telemetry_forward: send a button's presses from the interrupt
+ *
+ * Parameters:
+ *		button_t button
+ *			From debounce_init
+ *		uint8_t id
+ *			Application chosen button number
+ * Returns:
+ *		SERIAL_OK if the button is forwarded from now on
+ *		SERIAL_ERROR if TELEMETRY_FORWARD_BUTTONS are already
+ *
+ * button_check no longer sees the button's presses. Call before
+ * interrupts are enabled.
+ *********************************************************************/
+extern return_code_t telemetry_forward(button_t, uint8_t);
+
+/*********************************************************************
+ * telemetry_button_event: the DEBOUNCE_EVENT_HANDLER
+ *
+ * Called by the debounce interrupt, not by the application.
+ *********************************************************************/
+extern uint8_t telemetry_button_event(button_t, button_press_t);
+#endif
+
+/*********************************************************************
+ * telemetry_dropped: get the number of frames dropped
+ *
+ * Returns:
+ *		uint16_t count
+ *			Frames not sent because the TX buffer was too full,
+ *			or the forwarding queue. Wraps around.
+ *********************************************************************/
+extern uint16_t telemetry_dropped(void);
+
+
+#endif /* TELEMETRY_H_ */
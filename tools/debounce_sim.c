@@ -0,0 +1,175 @@
+/************************************************************************
+ * debounce_sim
+ *
+ * Host simulation of the debounce state machine
+ *
+ * Usage: debounce_sim [-n presses] [-b slices] [-h slices]
+ *
+ * debounce.c is built unchanged against the register shim in tools/sim,
+ * with DEBOUNCE_ADAPTIVE. One button on PB3. Time advances in 10ms
+ * slices: PINB is set, then the debounce interrupt runs.
+ *
+ * A contact wears out: the first half of the presses are clean, and
+ * from then on the contact touches and then opens again for a while
+ * before it closes for good. Options:
+ *		-n	Presses, 20 by default
+ *		-b	Slices the worn contact stays open, 6 by default
+ *		-h	Slices each press is held, bounce included, 30 by default
+ *
+ * The clean presses bring the window down towards the minimum.
+ * A worn press is then still open at the short sample and dropped,
+ * which has to widen the window until the presses come through
+ * again. One line per press has the window the press was sampled
+ * with and what button_check returned.
+ *
+ * The exit status is 1 if a clean press is lost, or the worn presses
+ * never come through again, so this can run as a regression check.
+ *
+ * Build with: make sim-debounce
+ ************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+#include "../debounce.h"
+
+#define SIM_DEFINE(name)	volatile uint8_t name;
+SIM_REGISTERS(SIM_DEFINE)
+#undef SIM_DEFINE
+
+#ifdef DEBOUNCE_TIMER1
+void TIM1_COMPA_vect(void);
+#define debounce_isr()		TIM1_COMPA_vect()
+#else
+void TIM0_COMPA_vect(void);
+#define debounce_isr()		TIM0_COMPA_vect()
+#endif
+
+#define BUTTON_PIN			PB3
+
+// From the press to the next one: the state machine back at rest
+// and the longest dead time over
+#define PRESS_PERIOD		(DEBOUNCE_COUNT_LONG + DEBOUNCE_DEAD_TIME_LONG + 10)
+
+void sim_sei(void)
+{
+}
+
+static const char *press_names[] = {"none", "short", "long"};
+
+/************************************************************************
+ * slice: one 10ms slice with the button closed or open
+ ************************************************************************/
+
+static void slice(int closed)
+{
+
+	if (closed)
+		PINB &= ~(1 << BUTTON_PIN);
+	else
+		PINB |= (1 << BUTTON_PIN);
+	debounce_isr();
+
+}
+
+/************************************************************************
+ * press: one press, held for hold slices
+ *
+ * A worn contact touches and opens again for bounce slices before it
+ * closes. Returns what the library made of it.
+ ************************************************************************/
+
+static button_press_t press(button_t button, unsigned bounce, unsigned hold)
+{
+
+	button_press_t result = BUTTON_PRESS_NONE;
+	unsigned i;
+
+	// The main loop checks every slice, as dead time only starts
+	// once a press is acknowledged
+	for (i = 0; i < PRESS_PERIOD; i++) {
+		button_press_t check;
+
+		slice(i < hold && (i == 0 || i > bounce));
+		if ((check = button_check(button)) != BUTTON_PRESS_NONE) {
+			result = check;
+			button_acknowledge(button);
+		}
+	}
+
+	return result;
+
+}
+
+int main(int argc, char **argv)
+{
+
+	unsigned presses = 20;
+	unsigned bounce = 6;
+	unsigned hold = 30;
+	unsigned worn_at, i;
+	unsigned clean_lost = 0, worn_lost = 0, recovered_at = 0;
+	button_t button;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:b:h:")) != -1) {
+		switch (opt) {
+			case 'n': presses = atoi(optarg); break;
+			case 'b': bounce = atoi(optarg); break;
+			case 'h': hold = atoi(optarg); break;
+			default:
+				fprintf(stderr,
+					"Usage: %s [-n presses] [-b slices] [-h slices]\n",
+					argv[0]);
+				return 2;
+		}
+	}
+	if (hold <= bounce + DEBOUNCE_COUNT_SHORT || hold >= DEBOUNCE_COUNT_LONG) {
+		fprintf(stderr, "Hold has to be a short press, after the bounce\n");
+		return 2;
+	}
+
+	PINB = 0xff;
+	if ((button = debounce_init("PB3")) == NULL) {
+		fprintf(stderr, "debounce_init failed\n");
+		return 2;
+	}
+
+	worn_at = presses / 2;
+	printf("press  bounce  window  result\n");
+	for (i = 0; i < presses; i++) {
+
+		unsigned b = i < worn_at ? 0 : bounce;
+		uint8_t window = button_debounce_window(button);
+		button_press_t result = press(button, b, hold);
+
+		printf("%5u  %6u  %6u  %s\n", i, b, window, press_names[result]);
+
+		if (result == BUTTON_PRESS_SHORT) {
+			if (i >= worn_at && !recovered_at)
+				recovered_at = i;
+		} else if (i < worn_at) {
+			clean_lost++;
+		} else if (!recovered_at) {
+			worn_lost++;
+		} else {
+			// Lost again after coming through
+			recovered_at = 0;
+			worn_lost++;
+		}
+
+	}
+
+	printf("clean presses lost: %u\n", clean_lost);
+	if (recovered_at)
+		printf("worn presses lost: %u, through from press %u on\n",
+			worn_lost, recovered_at);
+	else
+		printf("worn presses lost: %u, never through again\n", worn_lost);
+
+	return clean_lost || !recovered_at;
+
+}
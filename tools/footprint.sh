@@ -0,0 +1,112 @@
+#!/bin/sh
+#########################################################################
+# footprint.sh
+#
+# Flash and RAM footprint of libserial and the debounce library across
+# a matrix of configurations
+#
+# Usage: tools/footprint.sh [config ...]	(from the top directory)
+#
+# Builds serial.c, debounce.c and tools/footprint_main.c for each
+# configuration in the table below, or only the ones named, and prints
+# one CSV line per configuration:
+#
+#	config			Name from the table
+#	text,data,bss		Whole image, from avr-size
+#	serial_text,debounce_text	.text of each library on its own
+#	heap			Bytes malloc'ed: buffers, buttons
+#	stack			Stack high-water mark of the test image
+#
+# heap and stack come from running the image in simavr, and are "-"
+# if it is not installed. A configuration that does not build shows
+# "error". Keep a copy of the output to catch regressions, e.g.
+#
+#	tools/footprint.sh > footprint.csv && git diff footprint.csv
+#########################################################################
+
+DEVICE=${DEVICE:-attiny85}
+CLOCK=${CLOCK:-8000000}
+SIMAVR=${SIMAVR:-simavr}
+COMPILE="avr-gcc -Wall -Os -mmcu=$DEVICE -DF_CPU=$CLOCK"
+
+configurations() {
+	cat <<EOF
+default
+full-duplex	-DSERIAL_FULL_DUPLEX
+autobaud	-DSERIAL_FULL_DUPLEX -DSERIAL_AUTOBAUD
+tx-usi		-DSERIAL_TX_USI -DDEBOUNCE_TIMER1
+pll		-DSERIAL_TIMER1_PLL
+channels-2	-DSERIAL_TX_CHANNELS=2
+channels-4	-DSERIAL_TX_CHANNELS=4
+buffers-16	-DSERIAL_FULL_DUPLEX -DTX_BUFFER_SIZE=16 -DRX_BUFFER_SIZE=16
+buffers-128	-DSERIAL_FULL_DUPLEX -DTX_BUFFER_SIZE=128 -DRX_BUFFER_SIZE=128
+stdio		-DSERIAL_STDIO
+buttons-1	-DFOOTPRINT_BUTTONS=1
+buttons-4	-DFOOTPRINT_BUTTONS=4
+buttons-8	-DFOOTPRINT_BUTTONS=8
+adaptive	-DDEBOUNCE_ADAPTIVE
+diagnostics	-DDEBOUNCE_DIAGNOSTICS
+chords		-DDEBOUNCE_CHORDS
+encoder		-DDEBOUNCE_ENCODER -DDEBOUNCE_ENCODER_VELOCITY
+ladder		-DDEBOUNCE_ADC_LADDER
+trace		-DDEBOUNCE_TRACE
+EOF
+}
+
+# text column of avr-size for an object or image
+text_size() {
+	avr-size "$1" | awk 'NR == 2 { print $1 }'
+}
+
+if ! command -v avr-gcc > /dev/null; then
+	echo "footprint.sh: avr-gcc not found" >&2
+	exit 2
+fi
+
+run=0
+if command -v "$SIMAVR" > /dev/null; then
+	run=1
+	COMPILE="$COMPILE -DFOOTPRINT_SIMAVR"
+fi
+
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+
+wanted=" $* "
+
+echo "config,text,data,bss,serial_text,debounce_text,heap,stack"
+
+configurations | while read -r name flags; do
+
+	if [ "$wanted" != "  " ] && [ "${wanted#* $name }" = "$wanted" ]; then
+		continue
+	fi
+
+	if ! $COMPILE $flags -c serial.c -o "$build/serial.o" ||
+			! $COMPILE $flags -c debounce.c -o "$build/debounce.o" ||
+			! $COMPILE $flags -c tools/footprint_main.c -o "$build/main.o" ||
+			! $COMPILE -o "$build/footprint.elf" "$build/main.o" \
+				"$build/serial.o" "$build/debounce.o"; then
+		echo "$name,error"
+		continue
+	fi 2> "$build/log"
+
+	sizes=$(avr-size "$build/footprint.elf" | awk 'NR == 2 { print $1 "," $2 "," $3 }')
+	serial_text=$(text_size "$build/serial.o")
+	debounce_text=$(text_size "$build/debounce.o")
+
+	heap=-
+	stack=-
+	if [ $run = 1 ]; then
+		report=$(timeout 60 "$SIMAVR" -m "$DEVICE" -f "$CLOCK" \
+				"$build/footprint.elf" 2>&1 | grep -o 'stack [0-9]* heap [0-9]*' | head -n 1)
+		if [ -n "$report" ]; then
+			set -- $report
+			stack=$2
+			heap=$4
+		fi
+	fi
+
+	echo "$name,$sizes,$serial_text,$debounce_text,$heap,$stack"
+
+done
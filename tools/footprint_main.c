@@ -0,0 +1,172 @@
+/************************************************************************
+ * footprint_main
+ *
+ * Test image for tools/footprint.sh: sets up libserial and the debounce
+ * library the way a small application would, runs them for a second
+ * and reports how much stack and heap that took.
+ *
+ * The stack is painted with STACK_PAINT before anything runs. At the
+ * end, the lowest unpainted byte above the heap is the high-water
+ * mark. The result goes out over serial as "stack N heap N", and to
+ * the simavr console when built with FOOTPRINT_SIMAVR, after which the
+ * image stops simavr by sleeping with interrupts off.
+ *
+ * Only what actually runs is measured: TX, the debounce tick with
+ * FOOTPRINT_BUTTONS buttons and one long press. RX needs input.
+ ************************************************************************/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
+
+#include "../debounce.h"
+#include "../serial.h"
+
+#ifdef FOOTPRINT_SIMAVR
+#include <simavr/avr/avr_mcu_section.h>
+AVR_MCU(F_CPU, "attiny85");
+AVR_MCU_SIMAVR_CONSOLE(&GPIOR0);
+#endif
+
+#ifndef FOOTPRINT_BUTTONS
+#define FOOTPRINT_BUTTONS	2
+#endif
+
+#define STACK_PAINT		0xc5
+
+extern uint8_t _end;
+extern uint8_t __stack;
+extern uint8_t __heap_start;
+extern char *__brkval;
+
+static char *button_pins[] = {"PB0", "PB2", "PB5", "PB1"};
+
+/************************************************************************
+ * paint_stack: fill all RAM above .bss with STACK_PAINT
+ *
+ * Runs from .init1, before the stack pointer is even set up, so it can
+ * not use the stack itself.
+ ************************************************************************/
+
+void paint_stack(void) __attribute__ ((naked, used, section(".init1")));
+
+void paint_stack(void)
+{
+
+	__asm volatile (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACK_PAINT));
+
+}
+
+/************************************************************************
+ * stack_used: bytes of stack touched so far
+ ************************************************************************/
+
+static uint16_t stack_used(void)
+{
+
+	uint8_t *p = __brkval ? (uint8_t *) __brkval : &__heap_start;
+
+	while (p <= &__stack && *p == STACK_PAINT)
+		p++;
+
+	return &__stack - p + 1;
+
+}
+
+/************************************************************************
+ * console: write a string to the simavr console, if there is one
+ ************************************************************************/
+
+static void console(const char *text)
+{
+
+#ifdef FOOTPRINT_SIMAVR
+	while (*text)
+		GPIOR0 = *text++;
+#else
+	(void) text;
+#endif
+
+}
+
+static void console_u16(uint16_t value)
+{
+
+	char digits[6];
+	uint8_t i = sizeof(digits) - 1;
+
+	digits[i] = 0;
+	do {
+		digits[--i] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	console(&digits[i]);
+
+}
+
+int main(void)
+{
+
+	uint16_t stack;
+	uint16_t heap;
+	uint8_t i;
+
+	serial_initialise();
+#ifndef TX_ONLY
+	serial_enable_receive();
+#endif
+
+	for (i = 0; i < FOOTPRINT_BUTTONS; i++)
+		button_auto_acknowledge(debounce_init(button_pins[i & 3]));
+
+	sei();
+
+	serial_send_P(PSTR("footprint\r\n"));
+
+	// A long press on the first button: drive its pin low
+	_delay_ms(200);
+	PORTB &= ~(1 << PB0);
+	DDRB |= (1 << PB0);
+	_delay_ms(1200);
+	DDRB &= ~(1 << PB0);
+	PORTB |= (1 << PB0);
+	_delay_ms(200);
+
+	stack = stack_used();
+	heap = __brkval ? (uint8_t *) __brkval - &__heap_start : 0;
+
+	serial_send_P(PSTR("stack "));
+	serial_put_u16(stack);
+	serial_send_P(PSTR(" heap "));
+	serial_put_u16(heap);
+	serial_send_P(PSTR("\r\n"));
+
+	console("stack ");
+	console_u16(stack);
+	console(" heap ");
+	console_u16(heap);
+	console("\n");
+
+	// Let the report go out, then stop. simavr quits here
+	_delay_ms(100);
+	cli();
+	sleep_mode();
+
+	while (1)
+		;
+
+}
@@ -0,0 +1,945 @@
+/************************************************************************
+ * serial_sim
+ *
+ * Host simulation of the libserial TX engines
+ *
+ * Usage: serial_sim [-l|-a|-f|-e|-t cycles] [workload ...]
+ *
+ * serial.c is built unchanged against the register shim in tools/sim,
+ * with the configuration in serial.h. Time advances in CPU cycles, see
+ * "Timer1 model" and "USI model" below. A UART receiver samples the TX
+ * pin in the middle of every bit, timed from the falling edge of the 
+ * start bit, like a real one, and the bytes are checked for framing and
+ * against what the workload queued.
+ *
+ * Options, in CPU cycles:
+ *		-l	USI engine: from the USI counter overflow to the interrupt's
+ *			first register write, 40 by default: vector, prologue and 
+ *			any other interrupt running first
+ *		-a	Timer1 engine: Compare Match A up to the port write, 25 by
+ *			default
+ *		-f	fetch_tx_byte, 80 by default
+ *		-e	The rest of Compare Match A, 40 by default
+ *		-t	SERIAL_TICK_HANDLER, 0 by default
+ *
+ * Built with SERIAL_FULL_DUPLEX, a host sends bytes 0 - 255 over and 
+ * over on RX throughout, and the main loop reads them back.
+ *
+ * Each workload queues a fixed number of bytes at a fixed interval of
+ * simulated time, as the main loop. A blocking write takes simulated
+ * time itself, and the next one is due on schedule regardless. Bytes
+ * are timestamped when the library takes them. The report has, per
+ * workload:
+ *		bytes		Bytes sent, and bytes the library would not take
+ *		errors		Framing errors and wrong or missing bytes
+ *		throughput	Bytes per second at SERIAL_SPEED, and the share of
+ *					the line used, counting 10 bits per byte
+ *		latency		Bit periods from being queued to the start bit,
+ *					average and maximum
+ *		occupancy	Most bytes in the TX buffer at once
+ * and for the Timer1 engine a second line with the longest wait for
+ * Compare Match A, compare matches lost because the last one was still
+ * pending, system ticks, and with RX the bytes received, wrong or 
+ * missing bytes, framing errors and overruns.
+ *
+ * With no workloads named all of them run. The exit status is 1 if any
+ * byte came out wrong, either way, so this can run as a regression 
+ * check.
+ *
+ * Build with: make sim, make sim-usi or make sim-rx
+ ************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include "../serial.h"
+
+#define SIM_DEFINE(name)	volatile uint8_t name;
+SIM_REGISTERS(SIM_DEFINE)
+#undef SIM_DEFINE
+
+#ifdef SERIAL_TX_USI
+void USI_OVF_vect(void);
+
+#define TIMER0_CS_MASK		0x07
+#define TX_CLOCK_RUNNING	(TCCR0B & TIMER0_CS_MASK)
+#else
+void TIM1_COMPA_vect(void);
+void TIM1_COMPB_vect(void);
+void PCINT0_vect(void);
+
+#define TX_CLOCK_RUNNING	(TCCR1 & TIMER1_CS_MASK)
+#endif
+
+// The line is drained once the clock stops, unless RX or the system
+// tick keeps it running
+#if defined(SERIAL_TX_USI) || (defined(TX_ONLY) && !defined(SERIAL_SYSTEM_TICK))
+#define TX_STOPPED			(!TX_CLOCK_RUNNING)
+#else
+#define TX_STOPPED			1
+#endif
+
+#define TIMER1_CS_MASK		0x0f
+#define MAX_QUEUED			65536		// Power of two
+#define DRAIN_LIMIT			100000		// Bit periods
+
+static const unsigned long speeds[] = {
+	2400, 9600, 19200, 38400, 57600, 115200, 230400, 250000
+};
+
+/************************************************************************
+ * Simulation state
+ ************************************************************************/
+
+static unsigned long now = 0;			// Bit periods since start
+static unsigned long cycle = 0;			// CPU cycles since start
+static unsigned long bit_cycles;		// From the timer settings
+
+// Set by sei(): the rest of an interrupt can be interrupted
+static int sei_seen = 0;
+
+// Bytes queued so far, with the time they were queued. Byte n is
+// always n & 0xff, so a lost or repeated byte shows up as wrong data.
+static unsigned long queued_at[MAX_QUEUED];
+static unsigned long queued = 0;
+static unsigned long rejected = 0;
+
+// Bytes a blocking write still has to hand over
+static uint16_t blocking_left = 0;
+
+// Line decoder: bit 0 is the start bit, 1 - 8 data, 9 the stop bit,
+// -1 while the line is idle
+static int decode_bit = -1;
+static uint8_t decode_byte = 0;
+static unsigned long sent = 0;
+static unsigned long framing_errors = 0;
+static unsigned long data_errors = 0;
+
+// Receiver: next sample, 0 while waiting for a start bit
+static unsigned long line_sample_at = 0;
+static int line_level = 1;
+
+// Statistics
+static unsigned long start_time = 0;
+static unsigned long latency_sum = 0;
+static unsigned long latency_max = 0;
+static unsigned long first_sent = 0;
+static unsigned occupancy_max = 0;
+
+/************************************************************************
+ * decode: one TX pin sample, taken in the middle of a bit period
+ ************************************************************************/
+
+static void decode(int level)
+{
+
+	unsigned long latency;
+
+	if (decode_bit < 0) {
+
+		if (level)
+			return;
+
+		// Start bit
+		if (sent < queued) {
+			latency = now - queued_at[sent & (MAX_QUEUED - 1)];
+			latency_sum += latency;
+			if (latency > latency_max)
+				latency_max = latency;
+		}
+		decode_bit = 1;
+		decode_byte = 0;
+
+	} else if (decode_bit <= 8) {
+
+		decode_byte >>= 1;
+		if (level)
+			decode_byte |= 0x80;
+		decode_bit++;
+
+	} else {
+
+		if (!level)
+			framing_errors++;
+		if (sent >= queued || decode_byte != (uint8_t) sent)
+			data_errors++;
+		sent++;
+		decode_bit = -1;
+
+	}
+
+}
+
+/************************************************************************
+ * receive: the TX pin level during one CPU cycle
+ ************************************************************************/
+
+static void receive(int level)
+{
+
+	if (!line_sample_at) {
+		if (line_level && !level)
+			line_sample_at = cycle + bit_cycles / 2;
+	} else if (cycle == line_sample_at) {
+		decode(level);
+		line_sample_at = decode_bit < 0 ? 0 : line_sample_at + bit_cycles;
+	}
+
+	line_level = level;
+
+}
+
+#ifdef SERIAL_TX_USI
+/************************************************************************
+ * USI model
+ *
+ * Time advances in CPU cycles. Each Timer0 compare match clocks the 
+ * USI: USIDR shifts left, taking in DI (PB0) at bit 0, here a random
+ * bit, and the 4 bit counter counts up. When it overflows, USIOIF is 
+ * set and the interrupt runs usi_latency cycles later, all at once.
+ * Writing USIOIF clears it. A write of 0 to TCNT0 restarts the bit 
+ * timing: the model keeps TCNT0 at 1 to notice it.
+ *
+ * DO is bit 7 of USIDR while the USI drives the pin, PORTB otherwise.
+ ************************************************************************/
+
+static const unsigned timer0_divisors[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+static unsigned usi_latency = 40;
+static unsigned long next_match = 0;
+static int usi_flag = 0;
+static unsigned long usi_flag_at = 0;
+
+static int usi_line(void)
+{
+
+	if (USICR & (1 << USIWM0))
+		return USIDR >> 7;
+
+	return (PORTB >> TX_PIN) & 1;
+
+}
+
+// After the library ran: act on what it wrote
+static void usi_sync(void)
+{
+
+	if (USISR & (1 << USIOIF)) {
+		USISR &= ~(1 << USIOIF);
+		usi_flag = 0;
+	}
+
+	if (TX_CLOCK_RUNNING)
+		bit_cycles = (unsigned long) (OCR0A + 1) *
+				timer0_divisors[TCCR0B & TIMER0_CS_MASK];
+
+	if (TCNT0 == 0) {
+		next_match = cycle + bit_cycles;
+		TCNT0 = 1;
+	}
+
+}
+
+static void usi_clock(void)
+{
+
+	uint8_t count = (USISR + 1) & 0x0f;
+
+	USIDR = USIDR << 1 | (rand() & 1);
+	USISR = (USISR & 0xf0) | count;
+
+	if (count == 0) {
+		usi_flag = 1;
+		usi_flag_at = cycle;
+	}
+
+}
+
+/************************************************************************
+ * sim_step: advance by one bit period
+ ************************************************************************/
+
+static void sim_step(void)
+{
+
+	unsigned long end;
+	unsigned occupancy = TX_BUFFER_SIZE - 1 - serial_tx_room();
+
+	if (occupancy > occupancy_max)
+		occupancy_max = occupancy;
+
+	// The main loop may just have written to the USI
+	usi_sync();
+
+	for (end = cycle + bit_cycles; cycle < end; cycle++) {
+
+		if (TX_CLOCK_RUNNING && cycle == next_match) {
+			usi_clock();
+			next_match += bit_cycles;
+		}
+
+		if (usi_flag && (USICR & (1 << USIOIE)) &&
+				cycle >= usi_flag_at + usi_latency) {
+			USI_OVF_vect();
+			usi_sync();
+		}
+
+		receive(usi_line());
+
+	}
+
+	now++;
+
+}
+#else
+/************************************************************************
+ * Timer1 model
+ *
+ * TCNT1 counts at the rate the CS1x bits set, from the system clock, 
+ * and clears after reaching OCR1C. Reaching OCR1A or OCR1B sets OCF1A or
+ * OCF1B. Writing PSR1 restarts the prescaler, and writing a flag to TIFR
+ * clears it. With RX, the host's edges set the pin change flag while 
+ * RX_PIN is in PCMSK. The host runs 0.5 % slow, so its bits drift 
+ * through every phase of Timer1.
+ *
+ * The highest pending interrupt is taken once the CPU is free: pin 
+ * change, Compare Match A, then Compare Match B. It runs ENTRY_CYCLES
+ * later, all at once, reading RX as it is at that time, and holds the 
+ * CPU for its cost. Compare Match A costs -a cycles to the port write, 
+ * plus -f before it if it loads a frame there, then -e and -t if it ran 
+ * the tick handler. Whatever follows a sei() holds nothing, as the 
+ * interrupts it lets in run first on the chip as well.
+ ************************************************************************/
+
+#define ENTRY_CYCLES		20		// Vector and prologue
+#define COMPB_CYCLES		60
+#define PCINT_CYCLES		50
+#define SAMPLE_SPACING		8		// RX_SAMPLE_SPACING, to the middle read
+#define HOST_DRIFT			1005	// Host bit period, 1/1000 of ours
+
+static unsigned compa_cycles = 25;
+static unsigned fetch_cycles = 80;
+static unsigned rest_cycles = 40;
+static unsigned tick_cycles = 0;
+
+static unsigned long prescale_at = 0;
+static int flag_a = 0;
+static int flag_b = 0;
+static unsigned long flag_a_at = 0;
+static void (*vector)(void) = 0;		// Taken, not run yet
+static unsigned long vector_at = 0;
+static unsigned long cpu_free_at = 0;
+static int tick_blocking = 0;
+
+// TX pin: the level on the line, and the one a port write puts there
+static int tx_line = 1;
+static int tx_next = 1;
+static unsigned long tx_next_at = 0;
+static int tx_frame_bit = 0;			// Bits out, 0 between frames
+
+// Statistics
+static unsigned long compa_late_max = 0;
+static unsigned long compa_lost = 0;
+static unsigned long ticks = 0;
+
+#ifndef TX_ONLY
+static int flag_pcint = 0;
+static unsigned long host_bit_cycles;	// In 1/1000 cycles
+static unsigned long host_start;
+static int host_line = 1;
+static uint8_t rx_expected = 0;
+static unsigned long rx_received = 0;
+static unsigned long rx_wrong = 0;
+
+// Host: start bit, 8 data bits, stop bit and one idle bit per byte
+static int host_level(unsigned long at)
+{
+
+	unsigned long long bits;
+	unsigned position;
+	uint8_t byte;
+
+	if (at < host_start)
+		return 1;
+
+	bits = (unsigned long long) (at - host_start) * 1000 / host_bit_cycles;
+	position = bits % 11;
+	byte = bits / 11;
+
+	if (position == 0)
+		return 0;
+	if (position <= 8)
+		return (byte >> (position - 1)) & 1;
+
+	return 1;
+
+}
+
+static void set_rx_pin(unsigned long at)
+{
+
+	PINB = (PINB & ~(1 << RX_PIN)) | host_level(at) << RX_PIN;
+
+}
+
+// The main loop: read what came in, which should be the next bytes
+static void check_rx(void)
+{
+
+	uint8_t data[RX_BUFFER_SIZE];
+	uint16_t count = serial_read(data, sizeof(data));
+	uint16_t i;
+
+	for (i = 0; i < count; i++) {
+		if (data[i] != rx_expected)
+			rx_wrong++;
+		rx_expected = data[i] + 1;
+	}
+	rx_received += count;
+
+}
+#endif
+
+#ifdef SERIAL_SYSTEM_TICK
+// SERIAL_TICK_HANDLER
+void sim_tick(void)
+{
+
+	ticks++;
+	if (!sei_seen)
+		tick_blocking = 1;
+
+}
+#endif
+
+static unsigned timer1_divisor(void)
+{
+
+	uint8_t select = TCCR1 & TIMER1_CS_MASK;
+
+	return select ? 1u << (select - 1) : 0;
+
+}
+
+// After the library ran: act on what it wrote
+static void timer1_sync(void)
+{
+
+	if (GTCCR & (1 << PSR1)) {
+		GTCCR &= ~(1 << PSR1);
+		prescale_at = cycle;
+	}
+
+	if (TIFR & (1 << OCF1A))
+		flag_a = 0;
+	if (TIFR & (1 << OCF1B))
+		flag_b = 0;
+	TIFR = 0;
+
+	if (TX_CLOCK_RUNNING)
+		bit_cycles = (unsigned long) (OCR1C + 1) * timer1_divisor();
+
+}
+
+static void timer1_count(void)
+{
+
+	unsigned divisor = timer1_divisor();
+
+	if (!divisor || cycle == prescale_at || (cycle - prescale_at) % divisor)
+		return;
+
+	TCNT1 = TCNT1 == OCR1C ? 0 : TCNT1 + 1;
+
+	if (TCNT1 == OCR1A) {
+		if (flag_a)
+			compa_lost++;
+		flag_a = 1;
+		flag_a_at = cycle;
+	}
+	if (TCNT1 == OCR1B)
+		flag_b = 1;
+
+}
+
+static void compare_match_a(void)
+{
+
+	int fetched = !tx_frame_bit;
+	int level;
+	unsigned long write_at = cycle + compa_cycles;
+
+	tick_blocking = 0;
+	TIM1_COMPA_vect();
+	level = (PORTB >> TX_PIN) & 1;
+
+	// Between frames the interrupt loads the next one. Before a sei()
+	// that holds up the port write and the CPU
+	cpu_free_at = write_at;
+	if (!sei_seen) {
+		if (fetched)
+			write_at += fetch_cycles;
+		cpu_free_at = write_at + rest_cycles;
+	}
+	if (tick_blocking)
+		cpu_free_at += tick_cycles;
+
+	tx_next = level;
+	tx_next_at = write_at;
+
+	// Start bit, 8 data bits, stop bit
+	if (tx_frame_bit)
+		tx_frame_bit = (tx_frame_bit + 1) % 10;
+	else if (!level)
+		tx_frame_bit = 1;
+
+}
+
+static void run_vector(void)
+{
+
+	void (*run)(void) = vector;
+
+	vector = 0;
+	sei_seen = 0;
+
+	if (run == TIM1_COMPA_vect) {
+		compare_match_a();
+	} else {
+#ifndef TX_ONLY
+		if (run == TIM1_COMPB_vect) {
+			set_rx_pin(cycle + SAMPLE_SPACING);
+			run();
+			cpu_free_at = cycle + COMPB_CYCLES;
+		} else {
+			set_rx_pin(cycle);
+			run();
+			cpu_free_at = cycle + PCINT_CYCLES;
+		}
+#endif
+	}
+
+	timer1_sync();
+
+}
+
+static void dispatch(void)
+{
+
+	if (vector) {
+		if (cycle == vector_at)
+			run_vector();
+		return;
+	}
+
+	if (cycle < cpu_free_at)
+		return;
+
+#ifndef TX_ONLY
+	if (flag_pcint && (GIMSK & (1 << PCIE))) {
+		flag_pcint = 0;
+		vector = PCINT0_vect;
+	} else
+#endif
+	if (flag_a && (TIMSK & (1 << OCIE1A))) {
+		flag_a = 0;
+		vector = TIM1_COMPA_vect;
+		if (cycle - flag_a_at > compa_late_max)
+			compa_late_max = cycle - flag_a_at;
+#ifndef TX_ONLY
+	} else if (flag_b && (TIMSK & (1 << OCIE1B))) {
+		flag_b = 0;
+		vector = TIM1_COMPB_vect;
+#endif
+	} else {
+		return;
+	}
+
+	vector_at = cycle + ENTRY_CYCLES;
+
+}
+
+/************************************************************************
+ * sim_step: advance by one bit period
+ ************************************************************************/
+
+static void sim_step(void)
+{
+
+	unsigned long end;
+	unsigned occupancy = TX_BUFFER_SIZE - 1 - serial_tx_room();
+#ifndef TX_ONLY
+	int level;
+#endif
+
+	if (occupancy > occupancy_max)
+		occupancy_max = occupancy;
+
+	// The main loop may just have started the clock
+	timer1_sync();
+
+	for (end = cycle + bit_cycles; cycle < end; cycle++) {
+
+		timer1_count();
+
+#ifndef TX_ONLY
+		level = host_level(cycle);
+		if (level != host_line && (PCMSK & (1 << RX_PIN)))
+			flag_pcint = 1;
+		host_line = level;
+#endif
+
+		dispatch();
+
+		if (cycle >= tx_next_at)
+			tx_line = tx_next;
+		receive(tx_line);
+
+	}
+
+#ifndef TX_ONLY
+	check_rx();
+#endif
+
+	now++;
+
+}
+#endif
+
+/************************************************************************
+ * sim_sei: sei() in the shim
+ ************************************************************************/
+
+void sim_sei(void)
+{
+
+	sei_seen = 1;
+
+}
+
+/************************************************************************
+ * sim_sleep: sleep_mode in the shim. Wakes up at the next interrupt
+ ************************************************************************/
+
+static void mark_queued(unsigned long count)
+{
+
+	while (count--)
+		queued_at[queued++ & (MAX_QUEUED - 1)] = now;
+
+}
+
+// serial_write_blocking only sleeps with the buffer full, and on waking
+// fills all the room there is: that much of the write is taken now
+static void mark_blocking(void)
+{
+
+	uint16_t count = serial_tx_room();
+
+	if (count > blocking_left)
+		count = blocking_left;
+	mark_queued(count);
+	blocking_left -= count;
+
+}
+
+void sim_sleep(void)
+{
+
+	sim_step();
+
+	if (blocking_left)
+		mark_blocking();
+
+}
+
+/************************************************************************
+ * Producer helpers: queue the next bytes of the sequence
+ ************************************************************************/
+
+static void fill(uint8_t *data, uint16_t length)
+{
+
+	uint16_t i;
+
+	for (i = 0; i < length; i++)
+		data[i] = queued + i;
+
+}
+
+// As many as fit, like an application that drops what does not
+static void queue_bytes(uint16_t length)
+{
+
+	uint8_t data[256];
+	uint16_t written;
+
+	fill(data, length);
+	written = serial_write(data, length);
+	mark_queued(written);
+	rejected += length - written;
+
+}
+
+// All of them, waiting for room
+static void queue_blocking(uint16_t length)
+{
+
+	uint8_t data[256];
+
+	fill(data, length);
+	blocking_left = length;
+	mark_blocking();
+	serial_write_blocking(data, length);
+
+}
+
+// Through a TX descriptor, produced from the interrupt
+struct stream {
+	uint8_t next;
+	uint16_t left;
+};
+
+static int16_t stream_producer(void *context)
+{
+
+	struct stream *stream = context;
+
+	if (!stream->left)
+		return -1;
+	stream->left--;
+
+	return stream->next++;
+
+}
+
+static void queue_stream(uint16_t length)
+{
+
+	static struct stream streams[TX_DESCRIPTOR_COUNT];
+	static uint8_t index = 0;
+	struct stream *stream = &streams[index];
+
+	// Still busy: the descriptor ring is full as well
+	if (stream->left) {
+		rejected += length;
+		return;
+	}
+
+	stream->next = queued;
+	stream->left = length;
+	if (serial_send_stream(stream_producer, stream) != SERIAL_OK) {
+		stream->left = 0;
+		rejected += length;
+		return;
+	}
+
+	mark_queued(length);
+	index = (index + 1) % TX_DESCRIPTOR_COUNT;
+
+}
+
+/************************************************************************
+ * Workloads
+ ************************************************************************/
+
+struct workload {
+	const char *name;
+	const char *description;
+	void (*queue)(uint16_t length);
+	uint16_t length;			// Bytes per write
+	unsigned long interval;		// Bit periods from one write to the next
+	unsigned long duration;		// Bit periods
+};
+
+static const struct workload workloads[] = {
+	{"steady", "1 byte per 11 bit periods", queue_bytes, 1, 11, 20000},
+	{"saturate", "1 byte per 10 bit periods, the line rate", queue_bytes,
+		1, 10, 20000},
+	{"burst", "48 bytes per 1000 bit periods", queue_bytes, 48, 1000, 20000},
+	{"overload", "100 bytes per 500 bit periods, buffer full", queue_bytes,
+		100, 500, 20000},
+	{"blocking", "200 bytes blocking per 4000 bit periods", queue_blocking,
+		200, 4000, 20000},
+	{"stream", "100 byte producer per 1500 bit periods", queue_stream,
+		100, 1500, 20000},
+};
+
+#define WORKLOAD_COUNT	(sizeof(workloads) / sizeof(workloads[0]))
+
+/************************************************************************
+ * run: run a workload, let the line drain and report
+ *
+ * Returns the number of wrong bytes
+ ************************************************************************/
+
+static unsigned long run(const struct workload *workload)
+{
+
+	unsigned long t;
+	unsigned long due = 0;
+	unsigned long elapsed;
+	unsigned long count;
+	unsigned long errors;
+	unsigned long baud = speeds[SERIAL_SPEED];
+#ifndef SERIAL_TX_USI
+#ifndef TX_ONLY
+	unsigned long first_received = rx_received;
+	unsigned long framing = serial_rx_framing_errors();
+	unsigned long overruns = serial_rx_overflows();
+
+	rx_wrong = 0;
+#endif
+	unsigned long first_tick = ticks;
+
+	compa_late_max = compa_lost = 0;
+#endif
+
+	start_time = now;
+	first_sent = sent;
+	latency_sum = latency_max = 0;
+	occupancy_max = 0;
+	rejected = 0;
+	framing_errors = data_errors = 0;
+
+	// Writes are due on schedule, even when one took simulated time
+	while (now - start_time < workload->duration) {
+		if (now - start_time >= due) {
+			workload->queue(workload->length);
+			due += workload->interval;
+		}
+		sim_step();
+	}
+
+	// Drain: until the clock stops and the last stop bit is decoded
+	for (t = 0; t < DRAIN_LIMIT; t++) {
+		if (TX_STOPPED && decode_bit < 0 && sent == queued)
+			break;
+		sim_step();
+	}
+
+	elapsed = now - start_time;
+	count = sent - first_sent;
+	errors = framing_errors + data_errors + (queued - sent);
+
+	printf("%-9s %7lu %8lu %6lu %6lu %9.0f %6.1f%% %8.1f %6lu %5u\n",
+			workload->name, count, rejected, framing_errors,
+			data_errors + (queued - sent),
+			(double) count * baud / elapsed,
+			100.0 * count * 10 / elapsed,
+			count ? (double) latency_sum / count : 0.0, latency_max,
+			occupancy_max);
+
+#ifndef SERIAL_TX_USI
+	printf("%-9s Compare Match A up to %lu cycles late, %lu lost, "
+			"%lu ticks\n", "", compa_late_max, compa_lost, ticks - first_tick);
+#ifndef TX_ONLY
+	framing = (uint16_t) (serial_rx_framing_errors() - framing);
+	overruns = (uint16_t) (serial_rx_overflows() - overruns);
+	printf("%-9s RX %lu bytes, %lu wrong or missing, %lu framing errors, "
+			"%lu overruns\n", "", rx_received - first_received, rx_wrong,
+			framing, overruns);
+	errors += rx_wrong + framing + overruns;
+#endif
+#endif
+
+	// Carry on from a clean state
+	sent = queued;
+	decode_bit = -1;
+
+	return errors;
+
+}
+
+int main(int argc, char **argv)
+{
+
+	unsigned long errors = 0;
+	unsigned i;
+	int arg = 1;
+
+	for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+
+		unsigned value = atoi(argv[arg + 1]);
+
+		switch (argv[arg][1]) {
+#ifdef SERIAL_TX_USI
+		case 'l': usi_latency = value; break;
+#else
+		case 'a': compa_cycles = value; break;
+		case 'f': fetch_cycles = value; break;
+		case 'e': rest_cycles = value; break;
+		case 't': tick_cycles = value; break;
+#endif
+		default:
+			fprintf(stderr, "Unknown option %s\n", argv[arg]);
+			return 2;
+		}
+
+	}
+
+	// The PLL locks at once here
+	PLLCSR = (1 << PLOCK);
+
+	if (serial_initialise() != SERIAL_OK) {
+		fprintf(stderr, "serial_initialise failed\n");
+		return 2;
+	}
+
+	printf("# %lu baud, TX buffer %d, %d descriptors. "
+			"Latency in bit periods.\n",
+			speeds[SERIAL_SPEED], TX_BUFFER_SIZE, TX_DESCRIPTOR_COUNT);
+	// Until the timer runs and tells
+	bit_cycles = (F_CPU + speeds[SERIAL_SPEED] / 2) / speeds[SERIAL_SPEED];
+#ifdef SERIAL_TX_USI
+	TCNT0 = 1;
+	printf("# USI engine, %lu cycles per bit, interrupt after %u cycles\n",
+			bit_cycles, usi_latency);
+#else
+	printf("# Timer1 engine, Compare Match A %u cycles to the port write, "
+			"fetch %u, rest %u, tick %u\n",
+			compa_cycles, fetch_cycles, rest_cycles, tick_cycles);
+#ifndef TX_ONLY
+	// RX idles high, and the host starts a little later
+	PINB |= (1 << RX_PIN);
+	serial_enable_receive();
+	host_bit_cycles = bit_cycles * HOST_DRIFT;
+	host_start = 100 * bit_cycles;
+	printf("# Host sending on RX throughout, bit period %.1f cycles\n",
+			host_bit_cycles / 1000.0);
+#endif
+#endif
+	printf("%-9s %7s %8s %6s %6s %9s %7s %8s %6s %5s\n",
+			"workload", "bytes", "rejected", "frame", "data",
+			"bytes/s", "line", "lat avg", "max", "occ");
+
+	if (arg >= argc) {
+		for (i = 0; i < WORKLOAD_COUNT; i++)
+			errors += run(&workloads[i]);
+		return errors ? 1 : 0;
+	}
+
+	for (; arg < argc; arg++) {
+
+		for (i = 0; i < WORKLOAD_COUNT; i++)
+			if (!strcmp(argv[arg], workloads[i].name))
+				break;
+
+		if (i == WORKLOAD_COUNT) {
+			fprintf(stderr, "Unknown workload %s. Workloads:\n", argv[arg]);
+			for (i = 0; i < WORKLOAD_COUNT; i++)
+				fprintf(stderr, "  %-9s %s\n", workloads[i].name,
+						workloads[i].description);
+			return 2;
+		}
+
+		errors += run(&workloads[i]);
+
+	}
+
+	return errors ? 1 : 0;
+
+}
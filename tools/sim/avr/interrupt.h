@@ -0,0 +1,28 @@
+/************************************************************************
+ * Host simulation shim: avr/interrupt.h
+ *
+ * An ISR is a plain function the driver calls. Interrupts are never
+ * nested or preempted: the driver only calls one between two calls
+ * into the library. sei() tells the driver, through sim_sei, that the
+ * rest of an interrupt would let others in.
+ ************************************************************************/
+
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#ifdef __cplusplus
+#define SIM_C_LINKAGE		extern "C"
+#else
+#define SIM_C_LINKAGE
+#endif
+
+// Vectors have C linkage, as with avr-libc, so a C driver can call an
+// ISR in C++
+#define ISR(vector, ...)	SIM_C_LINKAGE void vector(void); \
+							SIM_C_LINKAGE void vector(void)
+SIM_C_LINKAGE void sim_sei(void);
+
+#define sei()				sim_sei()
+#define cli()				do {} while (0)
+
+#endif /* SIM_AVR_INTERRUPT_H_ */
@@ -0,0 +1,94 @@
+/************************************************************************
+ * Host simulation shim: avr/io.h
+ *
+ * Just enough of the ATtiny85 for serial.c and debounce.c to build on
+ * the host. Registers are plain variables, defined by the simulation
+ * driver with SIM_REGISTERS. Nothing happens on a register write: the
+ * driver models the timers and pins it needs.
+ ************************************************************************/
+
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#define SIM_REGISTERS(r)	\
+	r(PINB) r(PORTB) r(DDRB) r(MCUCR) r(GIMSK) r(GIFR) r(PCMSK) \
+	r(TCCR0A) r(TCCR0B) r(TCNT0) r(OCR0A) r(OCR0B) \
+	r(TCCR1) r(GTCCR) r(TCNT1) r(OCR1A) r(OCR1B) r(OCR1C) r(PLLCSR) \
+	r(TIMSK) r(TIFR) \
+	r(ADMUX) r(ADCSRA) r(ADCSRB) r(ADCH) r(ADCL) r(DIDR0) \
+	r(USICR) r(USISR) r(USIDR) r(USIBR)
+
+#define SIM_DECLARE(name)	extern volatile uint8_t name;
+SIM_REGISTERS(SIM_DECLARE)
+#undef SIM_DECLARE
+
+// Pins
+#define PB0		0
+#define PB1		1
+#define PB2		2
+#define PB3		3
+#define PB4		4
+#define PB5		5
+
+// TIMSK / TIFR
+#define OCIE1A	6
+#define OCIE1B	5
+#define OCIE0A	4
+#define OCIE0B	3
+#define TOIE1	2
+#define TOIE0	1
+#define OCF1A	6
+#define OCF1B	5
+#define OCF0A	4
+#define OCF0B	3
+#define TOV1	2
+#define TOV0	1
+
+// Timer0
+#define WGM00	0
+#define WGM01	1
+#define WGM02	3
+#define CS00	0
+#define CS01	1
+#define CS02	2
+
+// Timer1
+#define CS10	0
+#define CS11	1
+#define CS12	2
+#define CS13	3
+#define CTC1	7
+#define PSR1	1
+#define PLOCK	0
+#define PLLE	1
+#define PCKE	2
+
+// Pin change interrupt
+#define PCIE	5
+
+// ADC
+#define ADLAR	5
+#define ADEN	7
+#define ADSC	6
+#define ADIE	3
+#define ADPS2	2
+#define ADPS1	1
+#define ADPS0	0
+
+// USI
+#define USIOIE	6
+#define USIWM0	4
+#define USICS0	2
+#define USIOIF	6
+
+#define _BV(bit)						(1 << (bit))
+#define bit_is_set(reg, bit)			((reg) & _BV(bit))
+#define bit_is_clear(reg, bit)			(!((reg) & _BV(bit)))
+#define loop_until_bit_is_set(reg, bit)	do {} while (bit_is_clear(reg, bit))
+
+// Timing is the driver's business
+#define __builtin_avr_delay_cycles(cycles)	((void) (cycles))
+
+#endif /* SIM_AVR_IO_H_ */
@@ -0,0 +1,22 @@
+/************************************************************************
+ * Host simulation shim: avr/pgmspace.h
+ *
+ * One address space: flash is ordinary memory.
+ ************************************************************************/
+
+#ifndef SIM_AVR_PGMSPACE_H_
+#define SIM_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P					const char *
+#define PSTR(s)					(s)
+#define pgm_read_byte(address)	(*(const uint8_t *) (address))
+#define pgm_read_word(address)	(*(const uint16_t *) (address))
+#define pgm_read_dword(address)	(*(const uint32_t *) (address))
+#define memcpy_P				memcpy
+#define strlen_P				strlen
+
+#endif /* SIM_AVR_PGMSPACE_H_ */
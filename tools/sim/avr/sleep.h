@@ -0,0 +1,18 @@
+/************************************************************************
+ * Host simulation shim: avr/sleep.h
+ *
+ * Sleeping until the next interrupt lets the simulation run on: the
+ * driver provides sim_sleep, which advances time by one step.
+ ************************************************************************/
+
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+extern void sim_sleep(void);
+
+#define SLEEP_MODE_IDLE			0
+#define SLEEP_MODE_PWR_DOWN		2
+#define set_sleep_mode(mode)	do {} while (0)
+#define sleep_mode()			sim_sleep()
+
+#endif /* SIM_AVR_SLEEP_H_ */
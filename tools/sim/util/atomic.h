@@ -0,0 +1,14 @@
+/************************************************************************
+ * Host simulation shim: util/atomic.h
+ *
+ * Nothing interrupts the library on the host, so a block is a block.
+ ************************************************************************/
+
+#ifndef SIM_UTIL_ATOMIC_H_
+#define SIM_UTIL_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type)	for (int atomic_once_ = 1; atomic_once_; atomic_once_ = 0)
+
+#endif /* SIM_UTIL_ATOMIC_H_ */
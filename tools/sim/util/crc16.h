@@ -0,0 +1,25 @@
+/************************************************************************
+ * Host simulation shim: util/crc16.h
+ *
+ * The CRC telemetry.c uses, bit by bit as avr-libc documents it.
+ ************************************************************************/
+
+#ifndef SIM_UTIL_CRC16_H_
+#define SIM_UTIL_CRC16_H_
+
+#include <stdint.h>
+
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data)
+{
+
+	uint8_t i;
+
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+
+	return crc;
+
+}
+
+#endif /* SIM_UTIL_CRC16_H_ */
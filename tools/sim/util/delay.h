@@ -0,0 +1,24 @@
+/************************************************************************
+ * Host simulation shim: util/delay.h
+ *
+ * A delay takes no time, unless the driver defines SIM_DELAY and
+ * sim_delay_ms to run the clock meanwhile.
+ ************************************************************************/
+
+#ifndef SIM_UTIL_DELAY_H_
+#define SIM_UTIL_DELAY_H_
+
+#define _delay_us(us)	((void) (us))
+
+#ifdef SIM_DELAY
+#ifdef __cplusplus
+extern "C"
+#endif
+void sim_delay_ms(double ms);
+
+#define _delay_ms(ms)	sim_delay_ms(ms)
+#else
+#define _delay_ms(ms)	((void) (ms))
+#endif
+
+#endif /* SIM_UTIL_DELAY_H_ */
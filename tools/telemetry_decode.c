@@ -0,0 +1,441 @@
+/************************************************************************
+ * telemetry_decode
+ *
+ * Host side decoder for the binary telemetry stream sent by telemetry.c
+ *
+ * Usage: telemetry_decode [-b baud] [-c] [-v file.vcd] [device | file | -]
+ *
+ * Reads a serial device (set to raw mode at the given baud rate, 9600
+ * by default), a captured file, or stdin, and prints one line per
+ * message. -c prints CSV instead, for further processing. Frames with
+ * a bad CRC or length are counted and skipped; a summary goes to stderr
+ * at the end of input.
+ *
+ * Trace captures (DEBOUNCE_TRACE) come out as one line per run: tick,
+ * PINB value and length in ticks. With -v they are also written as a
+ * VCD file, one signal per PORTB pin, for any waveform viewer.
+ *
+ * Build with: cc -Wall -O2 -o telemetry_decode telemetry_decode.c
+ ************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Must match telemetry.h
+#define TELEMETRY_BUTTON		1
+#define TELEMETRY_TICK			2
+#define TELEMETRY_DIAGNOSTICS	3
+#define TELEMETRY_TRACE			4
+#define TELEMETRY_USER			0x80
+
+#define MAX_FRAME		64		// Longer is garbage: resynchronise
+#define TICK_SECONDS	0.01	// Debounce slice
+
+static const char *press_names[] = {"none", "short", "long"};
+
+/************************************************************************
+ * Decoder state
+ ************************************************************************/
+
+static int csv = 0;
+static uint32_t last_tick = 0;	// Full tick from the last TICK message
+static unsigned long frames = 0;
+static unsigned long bad_frames = 0;
+
+// VCD output of trace captures
+static FILE *vcd = NULL;
+static int vcd_pins = -1;		// Last value written, -1 for none yet
+static uint32_t vcd_end = 0;	// Tick the last run ended
+
+/************************************************************************
+ * crc8: CRC-8, polynomial 0x07, as avr-libc's _crc8_ccitt_update
+ ************************************************************************/
+
+static uint8_t crc8(uint8_t crc, uint8_t data)
+{
+
+	int i;
+
+	crc ^= data;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+
+	return crc;
+
+}
+
+/************************************************************************
+ * cobs_decode: undo COBS encoding, in place
+ *
+ * Returns the decoded length, or -1 if the frame is malformed
+ ************************************************************************/
+
+static int cobs_decode(uint8_t *data, int length)
+{
+
+	int in = 0;
+	int out = 0;
+	int code;
+	int i;
+
+	while (in < length) {
+
+		code = data[in++];
+		if (code == 0 || in + code - 1 > length)
+			return -1;
+
+		for (i = 1; i < code; i++)
+			data[out++] = data[in++];
+
+		// A 0 between blocks, not after the last one
+		if (code < 0xff && in < length)
+			data[out++] = 0;
+
+	}
+
+	return out;
+
+}
+
+/************************************************************************
+ * get_u16 / get_u32: little endian fields
+ ************************************************************************/
+
+static unsigned get_u16(const uint8_t *p)
+{
+
+	return p[0] | p[1] << 8;
+
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+
+	return (uint32_t) get_u16(p) | (uint32_t) get_u16(p + 2) << 16;
+
+}
+
+/************************************************************************
+ * full_tick: rebuild a full tick from its low 16 bits
+ *
+ * Takes the first tick at or after the last full one with these low
+ * bits. Button messages follow their TICK message closely, so this is
+ * only wrong if a device goes quiet for over 10 minutes and its TICK
+ * message was lost.
+ ************************************************************************/
+
+static uint32_t full_tick(unsigned low)
+{
+
+	uint32_t tick = (last_tick & 0xffff0000UL) | low;
+
+	if (tick < last_tick)
+		tick += 0x10000UL;
+
+	return tick;
+
+}
+
+/************************************************************************
+ * vcd_run: add a trace run to the VCD file
+ *
+ * Only changes are written. Pins outside the traced mask read 0.
+ ************************************************************************/
+
+static void vcd_run(uint32_t tick, unsigned mask, unsigned pins, unsigned length)
+{
+
+	int i;
+
+	if (vcd_pins < 0) {
+		fprintf(vcd, "$timescale 10 ms $end\n$scope module PORTB $end\n");
+		for (i = 0; i < 6; i++)
+			if (mask & (1 << i))
+				fprintf(vcd, "$var wire 1 %c PB%d $end\n", '0' + i, i);
+		fprintf(vcd, "$upscope $end\n$enddefinitions $end\n");
+	}
+
+	if ((int) pins != vcd_pins) {
+		fprintf(vcd, "#%lu\n", (unsigned long) tick);
+		for (i = 0; i < 6; i++)
+			if (mask & (1 << i))
+				fprintf(vcd, "%d%c\n", (pins >> i) & 1, '0' + i);
+		vcd_pins = pins;
+	}
+
+	vcd_end = tick + length;
+
+}
+
+/************************************************************************
+ * print_trace: print the runs in a trace message
+ ************************************************************************/
+
+static void print_trace(const uint8_t *p, int length)
+{
+
+	uint32_t tick = get_u32(p);
+	unsigned mask = p[4];
+	int i;
+
+	for (i = 5; i + 1 < length; i += 2) {
+
+		if (csv)
+			printf("%lu,trace,%02x,%u\n", (unsigned long) tick, p[i], p[i + 1]);
+		else
+			printf("%10.2f  trace pins %02x mask %02x for %u\n",
+					tick * TICK_SECONDS, p[i], mask, p[i + 1]);
+
+		if (vcd)
+			vcd_run(tick, mask, p[i], p[i + 1]);
+
+		tick += p[i + 1];
+
+	}
+
+}
+
+/************************************************************************
+ * print_frame: decode and print one checked frame
+ ************************************************************************/
+
+static void print_frame(const uint8_t *frame, int length)
+{
+
+	uint8_t type = frame[0];
+	const uint8_t *p = frame + 1;
+	int i;
+
+	length--;
+
+	switch (type) {
+
+		case TELEMETRY_TICK:
+			if (length != 4)
+				break;
+			last_tick = get_u32(p);
+			if (csv)
+				printf("%lu,tick\n", (unsigned long) last_tick);
+			else
+				printf("%10.2f  tick %lu\n", last_tick * TICK_SECONDS,
+						(unsigned long) last_tick);
+			return;
+
+		case TELEMETRY_BUTTON:
+			if (length != 4)
+				break;
+			last_tick = full_tick(get_u16(p + 2));
+			if (csv)
+				printf("%lu,button,%u,%s\n", (unsigned long) last_tick,
+						p[0], p[1] < 3 ? press_names[p[1]] : "?");
+			else
+				printf("%10.2f  button %u %s\n", last_tick * TICK_SECONDS,
+						p[0], p[1] < 3 ? press_names[p[1]] : "?");
+			return;
+
+		case TELEMETRY_DIAGNOSTICS:
+			if (length != 10)
+				break;
+			if (csv)
+				printf("%lu,diagnostics,%u,%u,%u,%u,%u,%u\n",
+						(unsigned long) last_tick, p[0], get_u16(p + 1),
+						get_u16(p + 3), get_u16(p + 5), get_u16(p + 7),
+						p[9]);
+			else
+				printf("%10.2f  button %u glitches %u short %u long %u "
+						"dropped %u bounce %u\n",
+						last_tick * TICK_SECONDS, p[0], get_u16(p + 1),
+						get_u16(p + 3), get_u16(p + 5), get_u16(p + 7),
+						p[9]);
+			return;
+
+		case TELEMETRY_TRACE:
+			if (length < 7 || length > 11 || (length - 5) & 1)
+				break;
+			print_trace(p, length);
+			return;
+
+		default:
+			// User types: dump as hex
+			if (csv)
+				printf("%lu,type 0x%02x,", (unsigned long) last_tick, type);
+			else
+				printf("%10.2f  type 0x%02x", last_tick * TICK_SECONDS, type);
+			for (i = 0; i < length; i++)
+				printf(csv ? "%02x" : " %02x", p[i]);
+			printf("\n");
+			return;
+
+	}
+
+	bad_frames++;
+
+}
+
+/************************************************************************
+ * handle_frame: check and print a frame received up to a delimiter
+ ************************************************************************/
+
+static void handle_frame(uint8_t *frame, int length)
+{
+
+	uint8_t crc = 0;
+	int i;
+
+	if (length == 0)
+		return;		// Back to back delimiters
+
+	frames++;
+	length = cobs_decode(frame, length);
+	if (length < 2) {
+		bad_frames++;
+		return;
+	}
+
+	for (i = 0; i < length - 1; i++)
+		crc = crc8(crc, frame[i]);
+	if (crc != frame[length - 1]) {
+		bad_frames++;
+		return;
+	}
+
+	print_frame(frame, length - 1);
+	fflush(stdout);
+
+}
+
+/************************************************************************
+ * setup_tty: raw mode at the given baud rate
+ ************************************************************************/
+
+static int setup_tty(int fd, long baud)
+{
+
+	struct termios tio;
+	speed_t speed;
+
+	switch (baud) {
+		case 2400: speed = B2400; break;
+		case 9600: speed = B9600; break;
+		case 19200: speed = B19200; break;
+		case 38400: speed = B38400; break;
+		case 57600: speed = B57600; break;
+		case 115200: speed = B115200; break;
+		case 230400: speed = B230400; break;
+		default:
+			fprintf(stderr, "Unsupported baud rate %ld\n", baud);
+			return -1;
+	}
+
+	if (tcgetattr(fd, &tio) < 0)
+		return -1;
+
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+
+	return tcsetattr(fd, TCSANOW, &tio);
+
+}
+
+int main(int argc, char **argv)
+{
+
+	uint8_t frame[MAX_FRAME];
+	uint8_t buffer[256];
+	int length = 0;
+	int overlong = 0;
+	long baud = 9600;
+	int fd = 0;
+	int opt;
+	ssize_t n;
+	ssize_t i;
+
+	while ((opt = getopt(argc, argv, "b:cv:")) != -1) {
+		switch (opt) {
+			case 'b':
+				baud = strtol(optarg, NULL, 10);
+				break;
+			case 'c':
+				csv = 1;
+				break;
+			case 'v':
+				vcd = fopen(optarg, "w");
+				if (vcd == NULL) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr,
+					"Usage: %s [-b baud] [-c] [-v file.vcd] "
+					"[device | file | -]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind < argc && strcmp(argv[optind], "-")) {
+		fd = open(argv[optind], O_RDONLY | O_NOCTTY);
+		if (fd < 0) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	if (isatty(fd) && setup_tty(fd, baud) < 0) {
+		perror("Setting up serial port");
+		return 1;
+	}
+
+	if (csv)
+		printf("tick,message,fields\n");
+
+	while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			return 1;
+		}
+
+		for (i = 0; i < n; i++) {
+
+			if (buffer[i] == 0) {
+				if (overlong)
+					bad_frames++;
+				else
+					handle_frame(frame, length);
+				length = 0;
+				overlong = 0;
+			} else if (length < MAX_FRAME) {
+				frame[length++] = buffer[i];
+			} else {
+				overlong = 1;
+			}
+
+		}
+
+	}
+
+	if (vcd) {
+		// Close the last run
+		if (vcd_pins >= 0)
+			fprintf(vcd, "#%lu\n", (unsigned long) vcd_end);
+		fclose(vcd);
+	}
+
+	fprintf(stderr, "%lu frames, %lu bad\n", frames, bad_frames);
+
+	return 0;
+
+}
@@ -0,0 +1,198 @@
+/************************************************************************
+ * test_sim
+ *
+ * Host run of a test program: debounce_test.c or debounce_test_cpp.cpp
+ *
+ * Usage: test_sim [-n presses] [-s seed]
+ *
+ * The test program is built unchanged against the register shim in
+ * tools/sim, with its main renamed to test_main, and linked with this
+ * driver, built in the same language, instead of libserial. It runs
+ * its main loop as usual. Every _delay_ms runs the debounce interrupt
+ * once per 10ms slice, with PINB from a scripted run of presses on
+ * PB0 and PB2:
+ *		-n	Presses, 200 by default
+ *		-s	Seed, 1 by default
+ * Presses go to PB0, PB2 or both at once, with up to 3 slices of
+ * bounce, and are held from 1 slice, a glitch, to well past a long
+ * press. The gaps between them vary as well, so some presses land in
+ * dead time.
+ *
+ * Everything the program sends is printed, one line per
+ * serial_send_P, with the slice it was sent in. The same script gives
+ * the same output for both programs, if they behave the same; make
+ * test-compare runs both and compares them.
+ *
+ * Build with: make test-compare
+ ************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef SIM_DELAY
+#error Build with -DSIM_DELAY, so _delay_ms runs the clock
+#endif
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+
+// Built as C++ for debounce_test_cpp.cpp, so its test_main links.
+// libserial and the vector stay C
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "../serial.h"
+void TIM0_COMPA_vect(void);
+#ifdef __cplusplus
+}
+#endif
+
+// Built along with the test program, with -Dmain=test_main
+int test_main(void);
+#undef main
+
+#define SIM_DEFINE(name)	volatile uint8_t name;
+SIM_REGISTERS(SIM_DEFINE)
+#undef SIM_DEFINE
+
+#define BUTTON_PINS			(1 << PB0 | 1 << PB2)
+#define MAX_HOLD			150		// Slices, past DEBOUNCE_COUNT_LONG
+#define MAX_GAP				400
+#define MAX_BOUNCE			3
+
+static unsigned long slice = 0;		// Slices since start
+static unsigned long presses = 200;
+static unsigned long script_seed = 1;
+
+// Script state: the press in progress, or the gap after it
+static unsigned long press_count = 0;
+static uint8_t press_pins = 0;
+static unsigned hold_left = 0;
+static unsigned bounce_left = 0;
+static unsigned gap_left = 0;
+
+/************************************************************************
+ * script_random: the script's own generator, so both programs get the
+ * same presses whatever the C library does
+ ************************************************************************/
+
+static unsigned script_random(unsigned range)
+{
+
+	script_seed = script_seed * 1103515245UL + 12345;
+	return (unsigned) ((script_seed >> 16) & 0x7fff) % range;
+
+}
+
+/************************************************************************
+ * script_next: PINB for the next slice. Pressed is low.
+ ************************************************************************/
+
+static uint8_t script_next(void)
+{
+
+	uint8_t pressed = 0;
+
+	if (!hold_left && !gap_left) {
+		if (press_count == presses) {
+			fflush(stdout);
+			exit(0);
+		}
+		press_count++;
+		switch (script_random(3)) {
+			case 0: press_pins = 1 << PB0; break;
+			case 1: press_pins = 1 << PB2; break;
+			default: press_pins = BUTTON_PINS; break;
+		}
+		hold_left = 1 + script_random(MAX_HOLD);
+		bounce_left = script_random(MAX_BOUNCE + 1);
+		gap_left = 1 + script_random(MAX_GAP);
+	}
+
+	if (hold_left) {
+		hold_left--;
+		// Bounce: open every other slice at the start
+		if (!(bounce_left && (bounce_left-- & 1)))
+			pressed = press_pins;
+	} else {
+		gap_left--;
+	}
+
+	return ~pressed;
+
+}
+
+/************************************************************************
+ * sim_delay_ms: _delay_ms in the test program. The clock runs.
+ ************************************************************************/
+
+void sim_delay_ms(double ms)
+{
+
+	unsigned long slices = (unsigned long) (ms / 10);
+
+	while (slices--) {
+		PINB = (PINB & ~BUTTON_PINS) | (script_next() & BUTTON_PINS);
+		slice++;
+		TIM0_COMPA_vect();
+	}
+
+}
+
+void sim_sei(void)
+{
+}
+
+/************************************************************************
+ * libserial, as far as the test programs use it
+ ************************************************************************/
+
+return_code_t serial_initialise()
+{
+
+	return SERIAL_OK;
+
+}
+
+return_code_t serial_send_P(PGM_P data)
+{
+
+	printf("%8lu  ", slice);
+	for (; *data; data++) {
+		if (*data == '\r')
+			printf("\\r");
+		else if (*data == '\n')
+			printf("\\n");
+		else
+			putchar(*data);
+	}
+	putchar('\n');
+
+	return SERIAL_OK;
+
+}
+
+int main(int argc, char **argv)
+{
+
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+			case 'n': presses = strtoul(optarg, NULL, 0); break;
+			case 's': script_seed = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n presses] [-s seed]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	PINB = 0xff;
+	test_main();
+
+	return 1;	// Never gets here
+
+}
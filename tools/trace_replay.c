@@ -0,0 +1,151 @@
+/************************************************************************
+ * trace_replay
+ *
+ * Replay a trace capture through the debounce state machine on the host
+ *
+ * Usage: trace_replay pin ... [< trace.csv]
+ *
+ * Runs captured with DEBOUNCE_TRACE, as telemetry_decode -c prints
+ * them:
+ *		tick,trace,pins,length
+ * with pins in hex. Other lines are skipped, so the whole decoder
+ * output can go in:
+ *		telemetry_decode -c capture.bin | trace_replay PB0 PB2
+ *
+ * debounce.c is built unchanged against the register shim in tools/sim,
+ * with the configuration in debounce.h plus REPLAY_OPTIONS from the
+ * Makefile, e.g. make -B trace-replay REPLAY_OPTIONS=-DDEBOUNCE_ADAPTIVE.
+ * The pins named are registered as buttons, in order. Every slice of
+ * every run sets PINB, untraced pins high, and runs the debounce
+ * interrupt, after which the buttons are checked and acknowledged, as
+ * a main loop polling every slice would.
+ *
+ * Each press comes out as telemetry_decode -c prints a button message:
+ *		tick,button,id,press
+ * id being the position of the pin on the command line. Replaying the
+ * same capture with other settings shows what they would have made of
+ * it. Where the ticks of two runs do not join up, e.g. between two
+ * captures, the buttons are released for the gap and a note goes to
+ * stderr.
+ *
+ * Build with: make trace-replay
+ ************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avr/io.h>
+#include "../debounce.h"
+
+#define SIM_DEFINE(name)	volatile uint8_t name;
+SIM_REGISTERS(SIM_DEFINE)
+#undef SIM_DEFINE
+
+#ifdef DEBOUNCE_TIMER1
+void TIM1_COMPA_vect(void);
+#define debounce_isr()		TIM1_COMPA_vect()
+#else
+void TIM0_COMPA_vect(void);
+#define debounce_isr()		TIM0_COMPA_vect()
+#endif
+
+#ifdef DEBOUNCE_SERIAL_TICK
+#error Replay runs the debounce interrupt itself: no DEBOUNCE_SERIAL_TICK
+#endif
+
+#define MAX_BUTTONS			6
+#define MAX_GAP				1000	// Slices filled between captures
+
+static const char *press_names[] = {"none", "short", "long"};
+
+static button_t buttons[MAX_BUTTONS];
+static int num_buttons = 0;
+static unsigned long presses = 0;
+
+void sim_sei(void)
+{
+}
+
+/************************************************************************
+ * slice: one 10ms slice at tick with these pins
+ ************************************************************************/
+
+static void slice(unsigned long tick, uint8_t pins)
+{
+
+	int i;
+
+	PINB = pins;
+	debounce_isr();
+
+	for (i = 0; i < num_buttons; i++) {
+
+		button_press_t press = button_check(buttons[i]);
+
+		if (press != BUTTON_PRESS_NONE) {
+			printf("%lu,button,%d,%s\n", tick, i, press_names[press]);
+			button_acknowledge(buttons[i]);
+			presses++;
+		}
+
+	}
+
+}
+
+int main(int argc, char **argv)
+{
+
+	char line[128];
+	unsigned long tick, next_tick = 0, runs = 0, lineno = 0;
+	unsigned pins, length;
+	uint8_t mask = 0;
+	int i;
+
+	if (argc < 2 || argc - 1 > MAX_BUTTONS) {
+		fprintf(stderr, "Usage: %s pin ... [< trace.csv], up to %d pins\n",
+			argv[0], MAX_BUTTONS);
+		return 2;
+	}
+
+	PINB = 0xff;
+	for (i = 1; i < argc; i++) {
+		if ((buttons[num_buttons] = debounce_init(argv[i])) == NULL) {
+			fprintf(stderr, "Can not set up a button on %s\n", argv[i]);
+			return 2;
+		}
+		mask |= 1 << (argv[i][2] - '0');	// debounce_init checked it
+		num_buttons++;
+	}
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+
+		lineno++;
+		if (sscanf(line, "%lu,trace,%x,%u", &tick, &pins, &length) != 3)
+			continue;
+
+		if (runs && tick != next_tick) {
+			fprintf(stderr, "line %lu: tick %lu, expected %lu, ",
+				lineno, tick, next_tick);
+			if (tick > next_tick && tick - next_tick <= MAX_GAP) {
+				fprintf(stderr, "released meanwhile\n");
+				while (next_tick < tick)
+					slice(next_tick++, 0xff);
+			} else {
+				fprintf(stderr, "carrying on from there\n");
+			}
+		}
+
+		// Traced pins as captured, the rest high
+		pins = (pins & mask) | (uint8_t) ~mask;
+		for (next_tick = tick; next_tick < tick + length; next_tick++)
+			slice(next_tick, pins);
+		runs++;
+
+	}
+
+	fprintf(stderr, "%lu runs, %lu presses\n", runs, presses);
+
+	return 0;
+
+}